@@ -3,8 +3,23 @@
  * see INOTIFY(7)
  */
 
+#define _GNU_SOURCE
+
+#include <sys/fanotify.h>
 #include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/syscall.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
+#include <stdint.h>
+#include <time.h>
 #include <stdbool.h>
 #include <unistd.h>
 
@@ -13,13 +28,31 @@
 #include "FileMonitor.h"
 
 #ifdef DEBUG
-#include <stdio.h>
 #define NL "\n"
 #define WATCH_MASK IN_ALL_EVENTS
 #else
-#define WATCH_MASK (IN_DELETE_SELF | IN_CLOSE_WRITE)
+#define WATCH_MASK (IN_DELETE_SELF | IN_MOVE_SELF | IN_CLOSE_WRITE)
 #endif
 
+// detect creation and replacement of monitored paths
+#define PARENT_MASK (IN_CREATE | IN_MOVED_TO)
+
+// FM_DIR_SCOPED monitors get their events from the directory
+#define SCOPED_MASK (IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM)
+
+// directory of a pattern, see FileMonitor_monitorGlob()
+#define GLOB_MASK (IN_DELETE | IN_MOVED_FROM)
+
+// directories of a tree, see FileMonitor_monitorTree()
+#define TREE_MASK (PARENT_MASK | SCOPED_MASK)
+
+// added to any watch the directory may already have
+#define DIR_FLAGS (IN_ONLYDIR | IN_MASK_ADD)
+
+// filesystem marks of FM_BACKEND_FANOTIFY, FAN_MODIFY only if asked for
+#define FAN_MASK (FAN_CLOSE_WRITE | FAN_CREATE | FAN_DELETE |   \
+                  FAN_MOVED_FROM | FAN_MOVED_TO)
+
 
 #define FOR(x)                                  \
         for (struct FM *fm = x; fm < (x + FM_MAX_MONITORS); ++fm)
@@ -27,235 +60,3461 @@
 #define FOR_CONST(x)                            \
         for (const struct FM *fm = x; fm < (x + FM_MAX_MONITORS); ++fm)
 
-static void remove_monitor(struct FMHandle *h, struct FM* fm)
+/*
+ * Backends, selected per monitor. The inotify backend is the kernel
+ * watch of the file, with the watch of its parent directory for
+ * creation and replacement. The poll backend compares statx results
+ * in FileMonitor_poll(). The fanotify backend gets the events of all
+ * paths from the mark of their filesystem.
+ *
+ * Everything that differs between them goes through the table, a new
+ * backend is one entry. Only the order of the fallback is outside, see
+ * watch_with().
+ */
+struct Backend {
+        // return wd, FM_WD_POLLED, FM_WD_FANOTIFY, or -1 with errno set
+        int (*watch)(struct FMHandle *h, const struct FM *owner,
+                     const char *path, uint32_t mask);
+        // give up the watch of fm before it is removed, may be NULL
+        void (*release)(struct FMHandle *h, struct FM *fm);
+        // read and handle the pending events, see FileMonitor_dispatch()
+        void (*dispatch)(struct FMHandle *h);
+        // compare fm with its last state, see FileMonitor_poll(),
+        // return true if a callback ran. NULL for backends with events
+        bool (*poll)(struct FMHandle *h, struct FM *fm);
+        // creation and replacement are seen through the parent directory
+        bool parent;
+};
+
+static const struct Backend backends[FM_BACKENDS];
+
+static void bump_generation(struct FMHandle *h, const struct FM* fm)
 {
-        if (-1 != fm->wd) {
-                inotify_rm_watch(h->inotify_fd, fm->wd);
-        }
-        memset(fm, 0, sizeof(*fm));
-        fm->wd = -1;
-        --h->count;
+        __atomic_add_fetch(&h->generations[fm - h->monitors], 1,
+                           __ATOMIC_RELEASE);
 }
 
-static struct FM* findWd(struct FMHandle *h, const int wd)
+static void mark_dirty(struct FMHandle *h, const struct FM* fm)
 {
-        FOR (h->monitors) {
-                if (wd == fm->wd) {return fm;}
+        const int slot = fm - h->monitors;
+        __atomic_fetch_or(&h->dirty[slot / 64], 1ull << (slot % 64),
+                          __ATOMIC_RELEASE);
+}
+
+static void clear_dirty(struct FMHandle *h, const struct FM* fm)
+{
+        const int slot = fm - h->monitors;
+        __atomic_fetch_and(&h->dirty[slot / 64], ~(1ull << (slot % 64)),
+                           __ATOMIC_RELEASE);
+}
+
+static const char *nameOf(const char *path)
+{
+        const char *slash = strrchr(path, '/');
+        return slash ? slash + 1 : path;
+}
+
+static uint32_t hashName(const char *name)
+{
+        // FNV-1a
+        uint32_t hash = 2166136261u;
+        while (*name) {
+                hash ^= (unsigned char)*name++;
+                hash *= 16777619u;
         }
+        return hash;
+}
 
-        return NULL;
+/*
+ * Index of the wds of a handle, open addressing with linear probing as
+ * the index of a shared instance below
+ */
+
+static unsigned useHome(int wd)
+{
+        return ((uint32_t)wd * 2654435761u) & (FM_HANDLE_WDS - 1);
 }
 
-static struct FM* findPath(struct FMHandle *h, const char* path)
+static struct FMWdUse *useSlot(const struct FMHandle *h, int wd)
 {
-        FOR (h->monitors) {
-                if (fm->path[0] &&
-                    (0 == strncmp(path, fm->path, FM_PATH_MAX_LENGTH))) {
-                        return fm;
-                }
+        unsigned i = useHome(wd);
+        while (h->wd_uses[i].wd && (wd != h->wd_uses[i].wd)) {
+                i = (i + 1) & (FM_HANDLE_WDS - 1);
         }
+        return (struct FMWdUse *)&h->wd_uses[i];
+}
 
-        return NULL;
+// the entry of wd, added if missing
+static struct FMWdUse *useAdd(struct FMHandle *h, int wd)
+{
+        struct FMWdUse *u = useSlot(h, wd);
+        if (!u->wd) {
+                u->wd = wd;
+                u->users = 0;
+                u->dir = -1;
+                ++h->watches;
+        }
+        return u;
 }
 
-static void handleEvent(struct FMHandle *h, const struct inotify_event* event)
+// drop the entry of wd once nothing uses it
+static void useRelease(struct FMHandle *h, int wd)
 {
-        struct FM *fm = findWd(h, event->wd);
-        if (fm) {
-#ifdef DEBUG
-                printf("%s"NL, fm->path);
-                if (event->mask & IN_ACCESS) {printf(" IN_ACCESS" NL);}
-                else if (event->mask & IN_ATTRIB) {printf(" IN_ATTRIB" NL);}
-                else if (event->mask & IN_CLOSE_WRITE) {printf(" CLOSE_WRITE" NL);}
-                else if (event->mask & IN_CLOSE_NOWRITE) {printf(" IN_CLOSE_NOWRITE" NL);}
-                else if (event->mask & IN_CREATE) {printf(" IN_CREATE" NL);}
-                else if (event->mask & IN_DELETE) {printf(" IN_DELETE" NL);}
-                else if (event->mask & IN_DELETE_SELF) {printf(" IN_DELETE_SELF" NL);}
-                else if (event->mask & IN_MODIFY) {printf(" IN_MODIFY" NL);}
-                else if (event->mask & IN_MOVE_SELF) {printf(" IN_MOVE_SELF" NL);}
-                else if (event->mask & IN_MOVED_FROM) {printf(" IN_MOVED_FROM" NL);}
-                else if (event->mask & IN_MOVED_TO) {printf(" IN_MOVED_TO" NL);}
-                else if (event->mask & IN_OPEN) {printf(" IN_OPEN" NL);}
-#endif
+        struct FMWdUse *u = useSlot(h, wd);
+        if (!u->wd || u->users || (-1 != u->dir)) return;
 
-                if ((event->mask & IN_DELETE_SELF) &&
-                    fm->onDelete) {
+        --h->watches;
 
-                        if (FM_MONITOR != fm->onDelete(h, fm->path)) {
-                                remove_monitor(h, fm);
-                        }
-                        else {
-                                inotify_rm_watch(h->inotify_fd, fm->wd);
-                                fm->wd = -1;
-                        }
-                }
-                else if ((event->mask & IN_CLOSE_WRITE) &&
-                         fm->onUpdate) {
+        // shift back the entries probed past this one
+        unsigned hole = u - h->wd_uses;
+        unsigned i = hole;
+        for (;;) {
+                i = (i + 1) & (FM_HANDLE_WDS - 1);
+                if (!h->wd_uses[i].wd) break;
 
-                        if (FM_UNMONITOR == fm->onUpdate(h, fm->path)) {
-                                remove_monitor(h, fm);
-                        }
+                const unsigned home = useHome(h->wd_uses[i].wd);
+                if (((i - home) & (FM_HANDLE_WDS - 1)) >=
+                    ((i - hole) & (FM_HANDLE_WDS - 1))) {
+                        h->wd_uses[hole] = h->wd_uses[i];
+                        hole = i;
                 }
         }
+        h->wd_uses[hole].wd = 0;
 }
 
-int FileMonitor_init(struct FMHandle *h)
+static struct FMDir *findDirWd(const struct FMHandle *h, int wd)
 {
-        if (!h) return -1;
+        if (0 >= wd) return NULL;
 
-        // we can not know if h is already initialized or just not
-        // zero-initialized => scrap the hole thing
-        memset(h, 0, sizeof(*h));
+        const struct FMWdUse *u = useSlot(h, wd);
+        return (u->wd && (-1 != u->dir)) ? (struct FMDir *)&h->dirs[u->dir] : NULL;
+}
 
-        FOR(h->monitors) {fm->wd = -1;}
+// move a monitor from watch old to wd
+static void use_wd(struct FMHandle *h, int old, int wd)
+{
+        if (0 < old) {
+                --useSlot(h, old)->users;
+                useRelease(h, old);
+        }
+        if (0 < wd) {++useAdd(h, wd)->users;}
+}
 
-        h->inotify_fd = inotify_init1(IN_NONBLOCK);
+// does any monitor but owner, or any directory, use wd
+static bool wdInUse(const struct FMHandle *h, const struct FM *owner, int wd)
+{
+        const struct FMWdUse *u = useSlot(h, wd);
+        if (!u->wd) return false;
 
-        return h->inotify_fd;
+        const int users = u->users - ((owner && (wd == owner->wd)) ? 1 : 0);
+        return (0 < users) || (-1 != u->dir);
 }
 
-int FileMonitor_monitor(struct FMHandle *h, const char *path,
-                        FMOnWatchSetup onWatchSetup, FMOnUpdate onUpdate,
-                        FMOnDelete onDelete)
+/*
+ * Index of the handles using each wd of a shared instance, open
+ * addressing with linear probing
+ */
+
+static struct FMWdEntry *wdSlot(struct FMInstance *inst, int wd)
 {
-        int rv = -1;
+        unsigned i = ((uint32_t)wd * 2654435761u) & (FM_INSTANCE_WDS - 1);
+        while (inst->wds[i].wd && (wd != inst->wds[i].wd)) {
+                i = (i + 1) & (FM_INSTANCE_WDS - 1);
+        }
+        return &inst->wds[i];
+}
 
-        if (!h || (0 > h->inotify_fd)) return -1;
-        if (h->count >= FM_MAX_MONITORS) return -1;
-        if (!path) return -1;
+static uint64_t wdHandles(struct FMInstance *inst, int wd)
+{
+        return (0 < wd) ? wdSlot(inst, wd)->handles : 0;
+}
 
-        int wd = inotify_add_watch(h->inotify_fd, path, WATCH_MASK);
+static void wdRemove(struct FMInstance *inst, int wd)
+{
+        struct FMWdEntry *e = wdSlot(inst, wd);
+        if (!e->wd) return;
 
-        if (0 > wd) {
-                if (errno == ENOENT) {
-                        // indicate that path is not monitored
-                        rv = 0;
+        // shift back the entries probed past this one
+        unsigned hole = e - inst->wds;
+        unsigned i = hole;
+        for (;;) {
+                i = (i + 1) & (FM_INSTANCE_WDS - 1);
+                if (!inst->wds[i].wd) break;
+
+                const unsigned home = ((uint32_t)inst->wds[i].wd * 2654435761u) &
+                        (FM_INSTANCE_WDS - 1);
+                if (((i - home) & (FM_INSTANCE_WDS - 1)) >=
+                    ((i - hole) & (FM_INSTANCE_WDS - 1))) {
+                        inst->wds[hole] = inst->wds[i];
+                        hole = i;
                 }
         }
-        else {
-                rv = 1;
+        inst->wds[hole].wd = 0;
+        inst->wds[hole].handles = 0;
+        --inst->wd_count;
+}
+
+// record that h uses wd, return false if the index is full
+static bool index_wd(struct FMHandle *h, int wd)
+{
+        struct FMInstance *inst = h->instance;
+        if (!inst || (0 > wd)) return true;
+
+        struct FMWdEntry *e = wdSlot(inst, wd);
+        if (!e->wd) {
+                // keep a free slot, probing ends there
+                if (FM_INSTANCE_WDS - 1 <= inst->wd_count) return false;
+                e->wd = wd;
+                ++inst->wd_count;
         }
+        e->handles |= (uint64_t)1 << h->group;
+        return true;
+}
 
-        if (-1 != rv) {
-                // check if its a known path
-                bool found_existing = false;
-                struct FM *new_fm = NULL;
-                FOR (h->monitors) {
-                        if (0 == fm->path[0]) {
-                                new_fm = fm;
-                        }
-                        else if (0 == strcmp(path, fm->path)) {
-                                new_fm = fm;
-                                found_existing = true;
-                                break;
-                        }
+static void release_wd(struct FMHandle *h, const struct FM *owner, int wd)
+{
+        if ((0 > wd) || wdInUse(h, owner, wd)) return;
+
+        // other handles on the same instance may still use it
+        struct FMInstance *inst = h->instance;
+        if (inst) {
+                struct FMWdEntry *e = wdSlot(inst, wd);
+                e->handles &= ~((uint64_t)1 << h->group);
+                if (e->handles) return;
+                wdRemove(inst, wd);
+        }
+        inotify_rm_watch(h->inotify_fd, wd);
+}
+
+// add a watch, and index it for a shared instance
+static int add_watch(struct FMHandle *h, const char *path, uint32_t mask)
+{
+        const int wd = inotify_add_watch(h->inotify_fd, path, mask);
+        if ((0 <= wd) && !index_wd(h, wd)) {
+                if (!wdHandles(h->instance, wd)) {
+                        inotify_rm_watch(h->inotify_fd, wd);
                 }
-                if (!found_existing) {++h->count;}
+                errno = ENOSPC;
+                return -1;
+        }
+        return wd;
+}
 
-                new_fm->wd = wd;
-                new_fm->onWatchSetup = onWatchSetup;
-                new_fm->onUpdate = onUpdate;
-                new_fm->onDelete = onDelete;
-                strncpy(new_fm->path, path, FM_PATH_MAX_LENGTH-1);
+static void clear_dir(struct FMDir *d)
+{
+        memset(d, 0, sizeof(*d));
+        d->wd = -1;
+        d->tree = -1;
+        d->free_next = -1;
+        for (int i = 0; i < FM_DIR_BUCKETS; i++) {d->buckets[i] = -1;}
+}
 
-                if ((-1 != wd) && onWatchSetup) {
-                        if (FM_UNMONITOR == onWatchSetup(h, new_fm->path)) {
-                                remove_monitor(h, new_fm);
-                        }
+// take an unused directory for wd, NULL if there is none
+static struct FMDir *alloc_dir(struct FMHandle *h, int wd, const char *path)
+{
+        if (-1 == h->dir_free) return NULL;
+
+        struct FMDir *d = &h->dirs[h->dir_free];
+        h->dir_free = d->free_next;
+        d->free_next = -1;
+        d->wd = wd;
+        d->hash = hashName(path);
+        strncpy(d->path, path, FM_PATH_MAX_LENGTH-1);
+        useAdd(h, wd)->dir = d - h->dirs;
+        return d;
+}
+
+// put d back among the unused
+static void free_dir(struct FMHandle *h, struct FMDir *d)
+{
+        if (0 <= d->wd) {
+                useSlot(h, d->wd)->dir = -1;
+                useRelease(h, d->wd);
+        }
+        clear_dir(d);
+        d->free_next = h->dir_free;
+        h->dir_free = d - h->dirs;
+}
+
+// a wd just added is new to h and beyond the watch budget: give it back
+// with ENOSPC, a wd already used does not count
+static bool overBudget(struct FMHandle *h, int wd)
+{
+        if ((0 >= wd) || useSlot(h, wd)->wd || (h->watches < h->watch_budget)) {
+                return false;
+        }
+        release_wd(h, NULL, wd);
+        errno = ENOSPC;
+        return true;
+}
+
+static bool demote_one(struct FMHandle *h, const struct FM *keep);
+
+// add a directory watch within the watch budget, demoting monitors but
+// keep to make room
+static int watch_dir(struct FMHandle *h, const struct FM *keep,
+                     const char *path, uint32_t mask)
+{
+        for (;;) {
+                int wd = add_watch(h, path, mask);
+                if (overBudget(h, wd)) {wd = -1;}
+                if ((-1 != wd) || (ENOSPC != errno) || !demote_one(h, keep)) {
+                        return wd;
                 }
         }
-        return rv;
 }
 
-int FileMonitor_unMonitor(struct FMHandle *h, const char *path)
+static struct FMDir *acquire_dir(struct FMHandle *h, const struct FM *keep,
+                                 const char *path, uint32_t mask)
 {
-        int rv = -1;
+        const uint32_t hash = hashName(path);
 
-        if (!h || (0 > h->inotify_fd) || !path) return rv;
+        mask |= PARENT_MASK;
 
-        rv = 0;
-        struct FM *fm = findPath(h, path);
-        if (fm) {
-                remove_monitor(h, fm);
-                rv = 1;
+        for (struct FMDir *d = h->dirs; d < h->dirs + FM_MAX_DIRS; ++d) {
+                if ((0 <= d->wd) && (hash == d->hash) && (0 == strcmp(path, d->path))) {
+                        if ((mask & d->mask) != mask) {
+                                if (0 > add_watch(h, path,
+                                                          mask | DIR_FLAGS)) {
+                                        return NULL;
+                                }
+                                d->mask |= mask;
+                        }
+                        return d;
+                }
         }
-        return rv;
+
+        // fails if the directory is missing as well, then only
+        // reMonitorNonExistingPaths() will find the path
+        const int wd = watch_dir(h, keep, path, mask | DIR_FLAGS);
+        if (0 > wd) return NULL;
+
+        // another spelling of an already watched directory
+        struct FMDir *d = findDirWd(h, wd);
+        if (d) {
+                d->mask |= mask;
+                return d;
+        }
+
+        d = alloc_dir(h, wd, path);
+        if (!d) {
+                release_wd(h, NULL, wd);
+                return NULL;
+        }
+        d->mask = mask;
+        return d;
 }
 
-void FileMonitor_dispatch(struct FMHandle *h)
+// directory of path, false if path has no name
+static bool parentOf(const char *path, char *dir)
 {
-        if (!h || (0 > h->inotify_fd) || h->count == 0) return;
+        const char *name = nameOf(path);
+        if (0 == name[0]) return false;
 
-        // FIONREAD should return the number of bytes to read from the
-        // inotify_fd. Can this be used here to deplete the events
-        // instead of relying on the external select? man ioctl(2)
-        struct inotify_event *event = NULL;
-        char buf[128] = {0};
-        char *next_event_ptr = NULL;
+        strcpy(dir, ".");
+        if (name != path) {
+                // keep the slash for paths directly under /
+                const size_t len = (name - 1 == path) ? 1 : name - 1 - path;
+                memcpy(dir, path, len);
+                dir[len] = 0;
+        }
+        return true;
+}
 
-        const int numRead = read(h->inotify_fd, buf, sizeof(buf));
+// take a reference on the directory watch of the parent of path
+static struct FMDir *acquire_parent(struct FMHandle *h, const struct FM *keep,
+                                    const char *path, uint32_t mask)
+{
+        char dir[FM_PATH_MAX_LENGTH];
+        if (!parentOf(path, dir)) return NULL;
 
-        for (next_event_ptr = buf;
-             next_event_ptr < buf + numRead;
-             next_event_ptr += sizeof(*event) + event->len) {
+        struct FMDir *d = acquire_dir(h, keep, dir, mask);
+        if (d) {++d->refs;}
+        return d;
+}
 
-                event = (struct inotify_event *)next_event_ptr;
-                handleEvent(h, event);
+static void release_dir(struct FMHandle *h, struct FMDir *d)
+{
+        if (0 == --d->refs) {
+                const int wd = d->wd;
+                free_dir(h, d);
+                release_wd(h, NULL, wd);
         }
+}
+
+static void watch_parent(struct FMHandle *h, struct FM *fm)
+{
+        if ((-1 != fm->dir) || !backends[fm->backend].parent) return;
 
+        struct FMDir *d = acquire_parent(h, fm, fm->path,
+                                         (fm->flags & FM_DIR_SCOPED) ?
+                                         (SCOPED_MASK | fm->mask) : 0);
+        if (!d) return;
+
+        const int slot = fm - h->monitors;
+        int *bucket = &d->buckets[fm->name_hash & (FM_DIR_BUCKETS - 1)];
+
+        fm->dir = d - h->dirs;
+        fm->dir_next = *bucket;
+        *bucket = slot;
 }
 
-int FileMonitor_nonExistingPaths(const struct FMHandle *h)
+static void unwatch_parent(struct FMHandle *h, struct FM *fm)
 {
-        if (!h || (0 > h->inotify_fd)) return -1;
-        if (h->count == 0) return 0;
+        if (-1 == fm->dir) return;
 
-        int count = 0;
-        FOR_CONST (h->monitors) {
-                if ((fm->path[0] != 0) && (-1 == fm->wd)) {
-                        ++count;
-                }
+        struct FMDir *d = &h->dirs[fm->dir];
+        const int slot = fm - h->monitors;
+
+        int *link = &d->buckets[fm->name_hash & (FM_DIR_BUCKETS - 1)];
+        while ((-1 != *link) && (slot != *link)) {
+                link = &h->monitors[*link].dir_next;
         }
-        return count;
+        if (-1 != *link) {*link = fm->dir_next;}
+
+        fm->dir = -1;
+        fm->dir_next = -1;
+
+        release_dir(h, d);
 }
 
-void FileMonitor_reMonitorNonExistingPaths(struct FMHandle *h)
+/*
+ * Symlink chains
+ *
+ * A monitor with FM_FOLLOW_LINKS records the symlinks passed when its
+ * path is resolved and watches their directories. When one of them is
+ * created or renamed over the path is resolved again.
+ */
+
+// record the symlinks passed when resolving path, in order
+static void resolveLinks(const char *path, struct FMLinkChain *c)
 {
-        if (!h || (0 > h->inotify_fd) || h->count == 0) return;
+        char cur[PATH_MAX];
+        strncpy(cur, path, sizeof(cur) - 1);
+        cur[sizeof(cur) - 1] = 0;
 
-        FOR (h->monitors) {
-                if ((fm->path[0] != 0) && (-1 == fm->wd)) {
+        c->count = 0;
+
+        // same limit as the kernel, see path_resolution(7)
+        for (int hops = 0; hops < 40; hops++) {
+                bool found = false;
+
+                // check each prefix of cur ending at a slash or the end
+                for (size_t end = 1; cur[end - 1]; end++) {
+                        if (('/' != cur[end]) && (0 != cur[end])) continue;
+
+                        const char saved = cur[end];
+                        cur[end] = 0;
 
-                        fm->wd = inotify_add_watch(h->inotify_fd, fm->path,
-                                                   WATCH_MASK);
+                        struct stat st;
+                        char target[PATH_MAX];
+                        ssize_t len = -1;
+                        if ((0 == lstat(cur, &st)) && S_ISLNK(st.st_mode)) {
+                                len = readlink(cur, target, sizeof(target) - 1);
+                        }
+
+                        if (0 < len) {
+                                target[len] = 0;
 
-                        if ((-1 != fm->wd) && (fm->onWatchSetup)) {
-                                if (FM_UNMONITOR == fm->onWatchSetup(h, fm->path)) {
-                                        remove_monitor(h, fm);
+                                if (c->count < FM_MAX_LINKS) {
+                                        struct FMLink *l = &c->links[c->count++];
+                                        strncpy(l->path, cur, FM_PATH_MAX_LENGTH - 1);
+                                        l->path[FM_PATH_MAX_LENGTH - 1] = 0;
                                 }
+
+                                // replace the link with its target
+                                char next[PATH_MAX];
+                                const char *slash = strrchr(cur, '/');
+                                const int dirlen = ('/' == target[0] || !slash) ?
+                                        0 : (int)(slash - cur + 1);
+                                cur[end] = saved;
+                                const int n = snprintf(next, sizeof(next), "%.*s%s%s",
+                                                       dirlen, cur, target, cur + end);
+                                if ((0 > n) || (sizeof(next) <= (size_t)n)) return;
+                                memcpy(cur, next, sizeof(cur));
+                                found = true;
+                                break;
                         }
+
+                        cur[end] = saved;
                 }
+
+                if (!found) return;
         }
 }
 
-bool FileMonitor_isMonitored(struct FMHandle *h, const char* path)
+static struct FMLinkChain *chainOf(struct FMHandle *h, const struct FM *fm)
 {
-        if (!h || !path) return false;
+        return (-1 == fm->chain) ? NULL : &h->chains[fm->chain];
+}
 
-        return (NULL != findPath(h, path));
+static void unlink_chain(struct FMHandle *h, struct FMLinkChain *c)
+{
+        for (int i = 0; i < c->count; i++) {
+                if (-1 != c->links[i].dir) {
+                        release_dir(h, &h->dirs[c->links[i].dir]);
+                }
+        }
+        c->count = 0;
 }
 
-const struct FM * FileMonitor_next(const struct FMHandle *h, const struct FM *fm)
+static void release_chain(struct FMHandle *h, struct FM *fm)
 {
-        if (!h) return NULL;
+        struct FMLinkChain *c = chainOf(h, fm);
+        if (!c) return;
 
-        const struct FM* start = (NULL == fm) ? &h->monitors[0] : ++fm;
+        unlink_chain(h, c);
+        c->fm = -1;
+        fm->chain = -1;
+}
 
-        while (start != &h->monitors[FM_MAX_MONITORS]) {
-                if (0 != start->path[0]) {
-                        return start;
+// resolve the path of fm again and watch the directories of its links
+static void relink(struct FMHandle *h, struct FM *fm)
+{
+        if (!(fm->flags & FM_FOLLOW_LINKS)) return;
+
+        struct FMLinkChain *c = chainOf(h, fm);
+        for (int i = 0; !c && (i < FM_MAX_LINK_MONITORS); i++) {
+                if (-1 == h->chains[i].fm) {
+                        c = &h->chains[i];
+                        c->fm = fm - h->monitors;
+                        c->count = 0;
+                        fm->chain = i;
                 }
-                ++start;
         }
-        return NULL;
+        // out of chains, the path is resolved once as without the flag
+        if (!c) return;
+
+        // take the new references before dropping the old ones, to
+        // keep directories that are still in the chain watched
+        struct FMLinkChain old = *c;
+        resolveLinks(fm->path, c);
+
+        for (int i = 0; i < c->count; i++) {
+                struct FMLink *l = &c->links[i];
+                struct FMDir *d = acquire_parent(h, fm, l->path, 0);
+                l->dir = d ? (int)(d - h->dirs) : -1;
+                l->name_hash = hashName(nameOf(l->path));
+        }
+
+        unlink_chain(h, &old);
+}
+
+static uint64_t nowMs(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Retry heap
+ *
+ * Min-heap of the slots of missing paths without a parent directory
+ * watch, ordered by retry_at_ms.
+ */
+
+static bool retryBefore(const struct FMHandle *h, int a, int b)
+{
+        return h->monitors[h->retry_heap[a]].retry_at_ms <
+                h->monitors[h->retry_heap[b]].retry_at_ms;
+}
+
+static void retrySwap(struct FMHandle *h, int a, int b)
+{
+        const int slot = h->retry_heap[a];
+        h->retry_heap[a] = h->retry_heap[b];
+        h->retry_heap[b] = slot;
+        h->monitors[h->retry_heap[a]].heap_pos = a;
+        h->monitors[h->retry_heap[b]].heap_pos = b;
+}
+
+static void retrySift(struct FMHandle *h, int pos)
+{
+        while ((0 < pos) && retryBefore(h, pos, (pos - 1) / 2)) {
+                retrySwap(h, pos, (pos - 1) / 2);
+                pos = (pos - 1) / 2;
+        }
+        for (;;) {
+                const int left = 2 * pos + 1;
+                int min = pos;
+                if ((left < h->retry_count) && retryBefore(h, left, min)) {
+                        min = left;
+                }
+                if ((left + 1 < h->retry_count) && retryBefore(h, left + 1, min)) {
+                        min = left + 1;
+                }
+                if (min == pos) break;
+                retrySwap(h, pos, min);
+                pos = min;
+        }
+}
+
+// next retry in [delay/2, delay] to spread paths missing since the same time
+static void retryAfter(struct FMHandle *h, struct FM *fm, uint64_t now)
+{
+        // xorshift32
+        uint32_t x = h->retry_seed;
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        h->retry_seed = x;
+
+        const uint32_t half = fm->retry_delay_ms / 2;
+        fm->retry_at_ms = now + half + (half ? x % (half + 1) : 0);
+}
+
+static void unschedule(struct FMHandle *h, struct FM *fm)
+{
+        const int pos = fm->heap_pos;
+        if (-1 == pos) return;
+
+        fm->heap_pos = -1;
+        if (pos != --h->retry_count) {
+                h->retry_heap[pos] = h->retry_heap[h->retry_count];
+                h->monitors[h->retry_heap[pos]].heap_pos = pos;
+                retrySift(h, pos);
+        }
+}
+
+// keep fm in the retry heap while it needs to be polled for
+static void update_schedule(struct FMHandle *h, struct FM *fm)
+{
+        const bool poll = fm->path[0] && (-1 == fm->wd) && (-1 == fm->dir);
+
+        if (!poll) {
+                unschedule(h, fm);
+        }
+        else if (-1 == fm->heap_pos) {
+                fm->retry_delay_ms = FM_RETRY_MIN_MS;
+                retryAfter(h, fm, nowMs());
+
+                fm->heap_pos = h->retry_count++;
+                h->retry_heap[fm->heap_pos] = fm - h->monitors;
+                retrySift(h, fm->heap_pos);
+        }
+}
+
+/*
+ * Pending list
+ *
+ * Doubly linked list through the slots of monitors without a watch
+ */
+
+static void pending_add(struct FMHandle *h, struct FM *fm)
+{
+        if (fm->pending) return;
+
+        const int slot = fm - h->monitors;
+        fm->pending = true;
+        fm->pending_prev = -1;
+        fm->pending_next = h->pending_head;
+        if (-1 != h->pending_head) {
+                h->monitors[h->pending_head].pending_prev = slot;
+        }
+        h->pending_head = slot;
+        ++h->pending_count;
+}
+
+static void pending_remove(struct FMHandle *h, struct FM *fm)
+{
+        if (!fm->pending) return;
+
+        if (-1 != fm->pending_prev) {
+                h->monitors[fm->pending_prev].pending_next = fm->pending_next;
+        }
+        else {
+                h->pending_head = fm->pending_next;
+        }
+        if (-1 != fm->pending_next) {
+                h->monitors[fm->pending_next].pending_prev = fm->pending_prev;
+        }
+        fm->pending = false;
+        fm->pending_prev = -1;
+        fm->pending_next = -1;
+        --h->pending_count;
+}
+
+// monitors added in lazy mode, oldest first
+static void lazy_add(struct FMHandle *h, struct FM *fm)
+{
+        const int slot = fm - h->monitors;
+        fm->lazy_prev = h->lazy_tail;
+        fm->lazy_next = -1;
+        if (-1 != h->lazy_tail) {
+                h->monitors[h->lazy_tail].lazy_next = slot;
+        }
+        else {
+                h->lazy_head = slot;
+        }
+        h->lazy_tail = slot;
+        ++h->lazy_count;
+}
+
+static void lazy_remove(struct FMHandle *h, struct FM *fm)
+{
+        if (FM_WD_LAZY != fm->wd) return;
+
+        if (-1 != fm->lazy_prev) {
+                h->monitors[fm->lazy_prev].lazy_next = fm->lazy_next;
+        }
+        else {
+                h->lazy_head = fm->lazy_next;
+        }
+        if (-1 != fm->lazy_next) {
+                h->monitors[fm->lazy_next].lazy_prev = fm->lazy_prev;
+        }
+        else {
+                h->lazy_tail = fm->lazy_prev;
+        }
+        fm->lazy_prev = -1;
+        fm->lazy_next = -1;
+        --h->lazy_count;
+}
+
+static void set_wd(struct FMHandle *h, struct FM *fm, int wd)
+{
+        use_wd(h, fm->wd, wd);
+        if ((FM_WD_LAZY == wd) && (FM_WD_LAZY != fm->wd)) {
+                lazy_add(h, fm);
+        }
+        else if (FM_WD_LAZY != wd) {
+                lazy_remove(h, fm);
+        }
+        fm->wd = wd;
+        if (-1 == wd) {
+                pending_add(h, fm);
+        }
+        else {
+                pending_remove(h, fm);
+        }
+}
+
+// take fm out of the fanotify buckets, see fan_index()
+static void fan_unindex(struct FMHandle *h, struct FM *fm)
+{
+        if (-1 == fm->fan_bucket) return;
+
+        const int slot = fm - h->monitors;
+        int *link = &h->fan_buckets[fm->fan_bucket];
+        while (slot != *link) {link = &h->monitors[*link].fan_next;}
+        *link = fm->fan_next;
+        fm->fan_bucket = -1;
+        fm->fan_next = -1;
+}
+
+// close the fanotify group with its last monitor, leaving is going
+static void fan_release(struct FMHandle *h, struct FM *leaving)
+{
+        if (0 > h->fanotify_fd) return;
+
+        FOR (h->monitors) {
+                if (fm->path[0] && (fm != leaving) &&
+                    (FM_BACKEND_FANOTIFY == fm->backend)) return;
+        }
+        close(h->fanotify_fd);
+        h->fanotify_fd = -1;
+        memset(h->fan_marks, 0, sizeof(h->fan_marks));
+}
+
+// drop the kernel watch of an inotify monitor
+static void inotify_release(struct FMHandle *h, struct FM *fm)
+{
+        release_wd(h, fm, fm->wd);
+        use_wd(h, fm->wd, -1);
+}
+
+static void remove_monitor(struct FMHandle *h, struct FM* fm)
+{
+        const struct Backend *backend = &backends[fm->backend];
+        pending_remove(h, fm);
+        lazy_remove(h, fm);
+        unschedule(h, fm);
+        bump_generation(h, fm);
+        clear_dirty(h, fm);
+        if (backend->release) {backend->release(h, fm);}
+        unwatch_parent(h, fm);
+        release_chain(h, fm);
+        fan_unindex(h, fm);
+        if (fm->snapshot) {
+                FileMonitor_snapshotRelease(fm->snapshot);
+        }
+        memset(fm, 0, sizeof(*fm));
+        fm->wd = -1;
+        fm->dir = -1;
+        fm->dir_next = -1;
+        fm->heap_pos = -1;
+        fm->pending_prev = -1;
+        fm->pending_next = -1;
+        fm->lazy_prev = -1;
+        fm->lazy_next = -1;
+        fm->fan_bucket = -1;
+        fm->fan_next = -1;
+        fm->chain = -1;
+        fm->glob = -1;
+        --h->count;
+}
+
+/*
+ * Content hash, xxHash64. The four lanes are independent, the
+ * compiler keeps them in vector registers. Large files are cut in
+ * chunks hashed on several threads, the chunk hashes are hashed again.
+ */
+
+#define P64_1 0x9E3779B185EBCA87ULL
+#define P64_2 0xC2B2AE3D27D4EB4FULL
+#define P64_3 0x165667B19E3779F9ULL
+#define P64_4 0x85EBCA77C2B2AE63ULL
+#define P64_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+        return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const uint8_t *p)
+{
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+}
+
+static inline uint64_t hashRound(uint64_t acc, uint64_t input)
+{
+        return rotl64(acc + input * P64_2, 31) * P64_1;
+}
+
+static inline uint64_t hashMerge(uint64_t acc, uint64_t lane)
+{
+        return (acc ^ hashRound(0, lane)) * P64_1 + P64_4;
+}
+
+static uint64_t hashBytes(const uint8_t *p, size_t len, uint64_t seed)
+{
+        const uint8_t *const end = p + len;
+        uint64_t h;
+
+        if (32 <= len) {
+                uint64_t lanes[4] = {
+                        seed + P64_1 + P64_2, seed + P64_2, seed, seed - P64_1
+                };
+                for (; p + 32 <= end; p += 32) {
+                        for (int i = 0; i < 4; i++) {
+                                lanes[i] = hashRound(lanes[i], read64(p + 8 * i));
+                        }
+                }
+                h = rotl64(lanes[0], 1) + rotl64(lanes[1], 7) +
+                        rotl64(lanes[2], 12) + rotl64(lanes[3], 18);
+                for (int i = 0; i < 4; i++) {
+                        h = hashMerge(h, lanes[i]);
+                }
+        }
+        else {
+                h = seed + P64_5;
+        }
+        h += len;
+
+        for (; p + 8 <= end; p += 8) {
+                h = rotl64(h ^ hashRound(0, read64(p)), 27) * P64_1 + P64_4;
+        }
+        if (p + 4 <= end) {
+                uint32_t v;
+                memcpy(&v, p, sizeof(v));
+                h = rotl64(h ^ (v * P64_1), 23) * P64_2 + P64_3;
+                p += 4;
+        }
+        for (; p < end; ++p) {
+                h = rotl64(h ^ (*p * P64_5), 11) * P64_1;
+        }
+
+        h ^= h >> 33;
+        h *= P64_2;
+        h ^= h >> 29;
+        h *= P64_3;
+        h ^= h >> 32;
+        return h;
+}
+
+// read by each hash thread at once
+#define HASH_BLOCK (256 << 10)
+
+struct HashChunk {
+        pthread_t thread;
+        int fd;
+        uint64_t offset;
+        size_t len;
+        uint64_t seed;
+        uint64_t hash;
+        bool ok; // false if the range could not be read
+};
+
+// hash of the block hashes of a range, read with pread(): a mapping of
+// a file truncated meanwhile would fault with SIGBUS
+static void *hashChunk(void *arg)
+{
+        struct HashChunk *c = arg;
+        c->hash = c->seed;
+        c->ok = false;
+
+        uint8_t *buf = malloc(HASH_BLOCK);
+        if (!buf) return NULL;
+
+        c->ok = true;
+        for (size_t done = 0; done < c->len;) {
+                const size_t want = (c->len - done < HASH_BLOCK) ?
+                        c->len - done : HASH_BLOCK;
+                const ssize_t n = pread(c->fd, buf, want, c->offset + done);
+                if (0 > n) {
+                        c->ok = false;
+                        break;
+                }
+                // truncated meanwhile, the update of that is to come
+                if (0 == n) break;
+
+                const uint64_t pair[2] = {c->hash, hashBytes(buf, n, c->seed)};
+                c->hash = hashBytes((const void *)pair, sizeof(pair), c->seed);
+                done += n;
+        }
+        free(buf);
+        return NULL;
+}
+
+// hash the content of fd, false if it could not be read
+static bool hashContent(int fd, size_t len, uint64_t *hash)
+{
+        // small files in one read, xxHash64 of the content
+        if (len <= HASH_BLOCK) {
+                uint8_t *buf = malloc(len ? len : 1);
+                if (!buf) return false;
+                const ssize_t n = pread(fd, buf, len, 0);
+                if (0 <= n) {*hash = hashBytes(buf, n, 0);}
+                free(buf);
+                return 0 <= n;
+        }
+
+        size_t n = len / FM_HASH_PARALLEL_MIN;
+        if (n < 1) n = 1;
+        if (n > FM_HASH_THREADS) n = FM_HASH_THREADS;
+
+        // chunks of whole blocks, the rounding may leave fewer chunks
+        struct HashChunk chunks[FM_HASH_THREADS];
+        const size_t size = ((len / n) + HASH_BLOCK - 1) & ~(size_t)(HASH_BLOCK - 1);
+        n = (len + size - 1) / size;
+        for (size_t i = 0; i < n; i++) {
+                chunks[i].fd = fd;
+                chunks[i].offset = i * size;
+                chunks[i].len = (i + 1 < n) ? size : len - i * size;
+                chunks[i].seed = i;
+        }
+
+        // the calling thread takes the first chunk, and any not started
+        size_t started = 1;
+        for (; started < n; started++) {
+                if (pthread_create(&chunks[started].thread, NULL,
+                                   hashChunk, &chunks[started])) break;
+        }
+        for (size_t i = started; i < n; i++) {hashChunk(&chunks[i]);}
+        hashChunk(&chunks[0]);
+        for (size_t i = 1; i < started; i++) {
+                pthread_join(chunks[i].thread, NULL);
+        }
+
+        uint64_t hashes[FM_HASH_THREADS];
+        for (size_t i = 0; i < n; i++) {
+                if (!chunks[i].ok) return false;
+                hashes[i] = chunks[i].hash;
+        }
+        *hash = hashBytes((const void *)hashes, n * sizeof(hashes[0]), len);
+        return true;
+}
+
+static bool sameFile(const struct FMSnapshot *snap, const struct stat *st)
+{
+        return (snap->dev == st->st_dev) && (snap->ino == st->st_ino) &&
+                (snap->len == (size_t)st->st_size) &&
+                (snap->mtime_ns == (uint64_t)st->st_mtim.tv_sec * 1000000000 +
+                 st->st_mtim.tv_nsec);
+}
+
+// a snapshot of the same file taken for another monitor
+static struct FMSnapshot *sharedSnapshot(struct FMHandle *h, const struct FM *owner,
+                                         const struct stat *st)
+{
+        FOR (h->monitors) {
+                if ((fm != owner) && fm->snapshot && sameFile(fm->snapshot, st)) {
+                        return (struct FMSnapshot *)FileMonitor_snapshotRetain(fm->snapshot);
+                }
+        }
+        return NULL;
+}
+
+static void set_snapshot(struct FM *fm, struct FMSnapshot *snap)
+{
+        if (fm->snapshot) {
+                FileMonitor_snapshotRelease(fm->snapshot);
+        }
+        fm->snapshot = snap;
+}
+
+// map the file of fd, NULL on failure
+static struct FMSnapshot *newSnapshot(int fd, const struct stat *st)
+{
+        const size_t len = st->st_size;
+        const void *data = NULL;
+        if (len) {
+                data = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (MAP_FAILED == data) return NULL;
+        }
+
+        struct FMSnapshot *snap = malloc(sizeof(*snap));
+        if (!snap) {
+                if (len) {munmap((void *)data, len);}
+                return NULL;
+        }
+        snap->data = data;
+        snap->len = len;
+        snap->refs = 1;
+        snap->dev = st->st_dev;
+        snap->ino = st->st_ino;
+        snap->mtime_ns = (uint64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+        return snap;
+}
+
+/*
+ * Hash the file of fm for FM_HASH_CONTENT, read with pread(), and
+ * snapshot it for FM_SNAPSHOT, return true if the content changed or
+ * can not be read
+ */
+static bool refresh(struct FMHandle *h, struct FM *fm)
+{
+        if (!(fm->flags & (FM_HASH_CONTENT | FM_SNAPSHOT))) return true;
+
+        const bool was_hashed = fm->hashed;
+        fm->hashed = false;
+
+        const int fd = open(fm->path, O_RDONLY | O_CLOEXEC);
+        if (0 > fd) {
+                set_snapshot(fm, NULL);
+                return true;
+        }
+
+        struct stat st;
+        if ((0 != fstat(fd, &st)) || !S_ISREG(st.st_mode)) {
+                close(fd);
+                set_snapshot(fm, NULL);
+                return true;
+        }
+
+        uint64_t hash = 0;
+        const bool hashed = (fm->flags & FM_HASH_CONTENT) &&
+                hashContent(fd, st.st_size, &hash);
+
+        if (fm->flags & FM_SNAPSHOT) {
+                struct FMSnapshot *snap = sharedSnapshot(h, fm, &st);
+                set_snapshot(fm, snap ? snap : newSnapshot(fd, &st));
+        }
+        close(fd);
+
+        // not hashed, changed as far as we can tell
+        if (!hashed) return true;
+
+        const bool changed = !was_hashed || (hash != fm->content_hash);
+        fm->content_hash = hash;
+        fm->hashed = true;
+        return changed;
+}
+
+// fetch the metadata compared by FM_STAT_FILTER, return errno or 0
+static int take_stat(const char *path, struct FMStat *st)
+{
+        struct statx stx;
+        if (0 != statx(AT_FDCWD, path, AT_STATX_SYNC_AS_STAT,
+                       STATX_SIZE | STATX_INO | STATX_MTIME | STATX_CTIME, &stx)) {
+                st->valid = false;
+                return errno;
+        }
+
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+
+        st->size = stx.stx_size;
+        st->ino = stx.stx_ino;
+        st->dev = ((uint64_t)stx.stx_dev_major << 32) | stx.stx_dev_minor;
+        st->mtime_ns = stx.stx_mtime.tv_sec * 1000000000LL + stx.stx_mtime.tv_nsec;
+        st->ctime_ns = stx.stx_ctime.tv_sec * 1000000000LL + stx.stx_ctime.tv_nsec;
+        st->taken_ns = now.tv_sec * 1000000000LL + now.tv_nsec;
+        st->valid = true;
+        return 0;
+}
+
+static bool sameStat(const struct FMStat *a, const struct FMStat *b)
+{
+        // a write in the same timestamp tick as the cached stat would
+        // leave mtime as it was, as with racily clean files in git
+        return a->valid && b->valid &&
+                (a->mtime_ns < a->taken_ns - FM_STAT_RACY_NS) &&
+                (a->size == b->size) && (a->ino == b->ino) && (a->dev == b->dev) &&
+                (a->mtime_ns == b->mtime_ns) && (a->ctime_ns == b->ctime_ns);
+}
+
+// call onEvent, or callback with the path
+static int notify(struct FMHandle *h, struct FM *fm, FMOnUpdate callback)
+{
+        if (fm->onEvent) {
+                struct FMEvent event = h->event;
+                event.id = fm - h->monitors;
+                event.path = fm->path;
+                event.snapshot = fm->snapshot;
+                event.context = fm->context;
+                return fm->onEvent(h, &event);
+        }
+        return callback ? callback(h, fm->path) : FM_MONITOR;
+}
+
+// deliver the bytes appended to fm since the last call, see FM_TAIL
+static void tailed(struct FMHandle *h, struct FM *fm)
+{
+        bump_generation(h, fm);
+        if (h->dirty_mode) {
+                mark_dirty(h, fm);
+                return;
+        }
+
+        const int fd = open(fm->path, O_RDONLY | O_CLOEXEC);
+        if (0 > fd) return;
+
+        struct stat st;
+        if (0 != fstat(fd, &st)) {
+                close(fd);
+                return;
+        }
+
+        // rotated, or truncated
+        if ((fm->tail.ino != st.st_ino) || (fm->tail.dev != st.st_dev) ||
+            ((uint64_t)st.st_size < fm->tail.offset)) {
+                fm->tail.dev = st.st_dev;
+                fm->tail.ino = st.st_ino;
+                fm->tail.offset = 0;
+        }
+
+        // read, not mapped: a mapping of a file truncated meanwhile,
+        // as by logrotate copytruncate, would fault with SIGBUS
+        const uint64_t size = st.st_size;
+        while (fm->tail.offset < size) {
+                const uint64_t offset = fm->tail.offset;
+                const size_t want = (size - offset < FM_TAIL_WINDOW) ?
+                        size - offset : FM_TAIL_WINDOW;
+
+                const ssize_t len = pread(fd, h->tail_buf, want, offset);
+                // truncated since the fstat, taken up by its event
+                if (0 >= len) break;
+
+                h->event.offset = offset;
+                h->event.data = h->tail_buf;
+                h->event.len = len;
+                fm->tail.offset = offset + len;
+
+                const int rv = notify(h, fm, fm->onUpdate);
+
+                h->event.data = NULL;
+                h->event.len = 0;
+
+                if (FM_UNMONITOR == rv) {
+                        remove_monitor(h, fm);
+                        break;
+                }
+                if ((size_t)len < want) break;
+        }
+        close(fd);
+}
+
+// start tailing at the end of the file
+static void tail_start(struct FM *fm)
+{
+        struct stat st;
+        memset(&fm->tail, 0, sizeof(fm->tail));
+        if (0 == stat(fm->path, &st)) {
+                fm->tail.dev = st.st_dev;
+                fm->tail.ino = st.st_ino;
+                fm->tail.offset = st.st_size;
+        }
+}
+
+// monitors of the same inode share the wd, and its mask
+static int watch_file(struct FMHandle *h, const struct FM *owner,
+                      const char *path, uint32_t mask)
+{
+        const int wd = add_watch(h, path, WATCH_MASK | mask);
+        if (0 > wd) return wd;
+
+        // the mask was replaced, add back what other users of the
+        // inode asked for, a directory watch included
+        uint32_t shared = 0;
+        FOR (h->monitors) {
+                if ((fm != owner) && (wd == fm->wd)) {shared |= fm->mask;}
+        }
+        const struct FMDir *d = findDirWd(h, wd);
+        if (d) {shared |= d->mask;}
+        // monitors and directories in other handles of a shared instance
+        if (h->instance && (wdHandles(h->instance, wd) & ~((uint64_t)1 << h->group))) {
+                for (int i = 0; i < FM_MAX_GROUPS; i++) {
+                        const struct FMHandle *other = h->instance->handles[i];
+                        if (!other || (other == h)) continue;
+                        FOR_CONST (other->monitors) {
+                                if (wd == fm->wd) {shared |= fm->mask;}
+                        }
+                        if ((d = findDirWd(other, wd))) {shared |= d->mask;}
+                }
+        }
+        if (shared & ~mask) {
+                inotify_add_watch(h->inotify_fd, path, WATCH_MASK | shared | IN_MASK_ADD);
+        }
+        return wd;
+}
+
+// a polled file exists if it can be stat'ed
+static int watch_poll(struct FMHandle *h, const struct FM *owner,
+                      const char *path, uint32_t mask)
+{
+        struct statx stx;
+        if (0 != statx(AT_FDCWD, path, AT_STATX_SYNC_AS_STAT, STATX_TYPE, &stx)) {
+                return -1;
+        }
+        return FM_WD_POLLED;
+}
+
+// filesystem id and handle of dir, as reported by fanotify
+static bool fidOf(const char *dir, struct FMFid *fid)
+{
+        struct statfs sfs;
+        union {
+                struct file_handle fh;
+                unsigned char bytes[sizeof(struct file_handle) + FM_FID_MAX];
+        } u;
+        int mount_id;
+
+        fid->bytes = 0;
+        u.fh.handle_bytes = FM_FID_MAX;
+        if ((0 != statfs(dir, &sfs)) ||
+            (0 != name_to_handle_at(AT_FDCWD, dir, &u.fh, &mount_id, 0))) {
+                return false;
+        }
+        memcpy(&fid->fsid, &sfs.f_fsid, sizeof(fid->fsid));
+        fid->type = u.fh.handle_type;
+        fid->bytes = u.fh.handle_bytes;
+        memcpy(fid->handle, u.fh.f_handle, u.fh.handle_bytes);
+        return true;
+}
+
+// mark the filesystem of dir, once per filesystem and mask
+static bool fan_mark(struct FMHandle *h, const char *dir, uint64_t fsid,
+                     uint32_t mask)
+{
+        struct FMFanMark *mark = NULL;
+        for (int i = 0; !mark && (i < FM_MAX_FAN_MARKS); i++) {
+                if (h->fan_marks[i].mask && (fsid == h->fan_marks[i].fsid)) {
+                        mark = &h->fan_marks[i];
+                }
+        }
+        if (mark && ((mark->mask & mask) == mask)) return true;
+
+        for (int i = 0; !mark && (i < FM_MAX_FAN_MARKS); i++) {
+                if (!h->fan_marks[i].mask) {mark = &h->fan_marks[i];}
+        }
+        if (!mark) {
+                errno = ENOSPC;
+                return false;
+        }
+
+        if (0 != fanotify_mark(h->fanotify_fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+                               mask, AT_FDCWD, dir)) {
+                return false;
+        }
+        mark->fsid = fsid;
+        mark->mask |= mask;
+        return true;
+}
+
+// an existing file is seen through the mark of its filesystem
+static int watch_fanotify(struct FMHandle *h, const struct FM *owner,
+                          const char *path, uint32_t mask)
+{
+        char dir[FM_PATH_MAX_LENGTH];
+        struct FMFid fid;
+        if (!parentOf(path, dir) || !fidOf(dir, &fid)) return -1;
+
+        if (0 > h->fanotify_fd) {
+                h->fanotify_fd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME |
+                                               FAN_NONBLOCK | FAN_CLOEXEC, O_RDONLY);
+                if (0 > h->fanotify_fd) return -1;
+        }
+        if (!fan_mark(h, dir, fid.fsid,
+                      FAN_MASK | ((mask & IN_MODIFY) ? FAN_MODIFY : 0))) {
+                return -1;
+        }
+
+        if (0 != access(path, F_OK)) return -1;
+        return FM_WD_FANOTIFY;
+}
+
+// bucket of the monitors of a name in the directory of a file handle
+static int fanBucket(uint64_t fsid, const unsigned char *handle,
+                     unsigned bytes, uint32_t name_hash)
+{
+        return hashBytes(handle, bytes, fsid ^ name_hash) & (FM_FAN_BUCKETS - 1);
+}
+
+// events of fanotify name fm by its directory, index it by that
+static void fan_index(struct FMHandle *h, struct FM *fm)
+{
+        fan_unindex(h, fm);
+
+        char dir[FM_PATH_MAX_LENGTH];
+        if (!parentOf(fm->path, dir) || !fidOf(dir, &fm->parent)) {
+                fm->parent.bytes = 0;
+                return;
+        }
+        fm->fan_bucket = fanBucket(fm->parent.fsid, fm->parent.handle,
+                                   fm->parent.bytes, fm->name_hash);
+        fm->fan_next = h->fan_buckets[fm->fan_bucket];
+        h->fan_buckets[fm->fan_bucket] = fm - h->monitors;
+}
+
+// max_user_watches, shared by all inotify instances of the user
+static int kernelWatchLimit(void)
+{
+        int limit = -1;
+        FILE *f = fopen("/proc/sys/fs/inotify/max_user_watches", "r");
+        if (f) {
+                if (1 != fscanf(f, "%d", &limit)) {limit = -1;}
+                fclose(f);
+        }
+        return (0 < limit) ? limit : INT_MAX;
+}
+
+// move fm to polling, with its file and directory watches
+static void demote(struct FMHandle *h, struct FM *fm)
+{
+        const int wd = fm->wd;
+        fm->backend = FM_BACKEND_POLL;
+        fm->demoted = true;
+        set_wd(h, fm, FM_WD_POLLED);
+        release_wd(h, fm, wd);
+        unwatch_parent(h, fm);
+        take_stat(fm->path, &fm->stat);
+}
+
+// make room for a watch, false if no monitor can give up its own
+static bool demote_one(struct FMHandle *h, const struct FM *keep)
+{
+        struct FM *victim = NULL;
+        FOR (h->monitors) {
+                if (!fm->path[0] || (fm == keep) || (0 > fm->wd) ||
+                    (FM_BACKEND_INOTIFY != fm->backend) || fm->subscriber ||
+                    (-1 != fm->chain) || (-1 != fm->glob)) continue;
+
+                if (!victim || (fm->changed_ms < victim->changed_ms)) {victim = fm;}
+        }
+        if (!victim) return false;
+
+        demote(h, victim);
+        return true;
+}
+
+// watch path with *backend, fall back from fanotify to inotify and
+// from inotify to polling when the watch budget is used up
+static int watch_with(struct FMHandle *h, const struct FM *owner, const char *path,
+                      uint32_t mask, enum FMBackendKind *backend)
+{
+        int wd = -1;
+        for (;;) {
+                wd = backends[*backend].watch(h, owner, path, mask);
+                if ((FM_BACKEND_INOTIFY == *backend) && overBudget(h, wd)) {
+                        wd = -1;
+                }
+
+                if ((-1 == wd) && (FM_BACKEND_FANOTIFY == *backend) && (ENOENT != errno)) {
+                        // no privilege for filesystem marks, or no fanotify
+                        *backend = FM_BACKEND_INOTIFY;
+                        fan_release(h, NULL);
+                        continue;
+                }
+                if ((-1 != wd) || (ENOSPC != errno) ||
+                    (FM_BACKEND_INOTIFY != *backend)) break;
+
+                // least recently changed monitors are polled first
+                if (!demote_one(h, owner)) {
+                        *backend = FM_BACKEND_POLL;
+                }
+        }
+        return wd;
+}
+
+// a demoted monitor got busy, watch it again
+static void promote(struct FMHandle *h, struct FM *fm)
+{
+        enum FMBackendKind backend = FM_BACKEND_INOTIFY;
+        const int wd = watch_with(h, fm, fm->path, fm->mask, &backend);
+        if ((0 > wd) || (FM_BACKEND_INOTIFY != backend)) return;
+
+        fm->backend = FM_BACKEND_INOTIFY;
+        fm->demoted = false;
+        set_wd(h, fm, wd);
+        watch_parent(h, fm);
+}
+
+/*
+ * Try to watch the path of a monitor without a watch
+ *
+ * onWatchSetup may remove fm
+ *
+ * return true if the watch is setup
+ */
+static bool attach(struct FMHandle *h, struct FM *fm)
+{
+        relink(h, fm);
+        if (FM_BACKEND_FANOTIFY == fm->backend) {
+                // the directory may have been created again
+                fan_index(h, fm);
+        }
+
+        int wd = -1;
+        if (fm->flags & FM_DIR_SCOPED) {
+                // only exists as seen through the directory watch
+                watch_parent(h, fm);
+                if ((-1 != fm->dir) && (0 == access(fm->path, F_OK))) {
+                        wd = FM_WD_SCOPED;
+                }
+        }
+        else {
+                const enum FMBackendKind backend = fm->backend;
+                wd = watch_with(h, fm, fm->path, fm->mask, &fm->backend);
+                if (backend == fm->backend) {
+                        // unchanged
+                }
+                else if (backends[fm->backend].parent) {
+                        // creation is now seen through the directory
+                        watch_parent(h, fm);
+                }
+                else if (FM_BACKEND_POLL == fm->backend) {
+                        fm->demoted = true;
+                }
+        }
+        if (-1 == wd) return false;
+
+        set_wd(h, fm, wd);
+        unschedule(h, fm);
+        if ((fm->flags & FM_STAT_FILTER) || backends[fm->backend].poll) {
+                take_stat(fm->path, &fm->stat);
+        }
+        refresh(h, fm);
+
+        if (fm->onWatchSetup &&
+            (FM_UNMONITOR == fm->onWatchSetup(h, fm->path))) {
+                remove_monitor(h, fm);
+        }
+        else if (fm->flags & FM_TAIL) {
+                // a new file, written before it was watched
+                tailed(h, fm);
+        }
+        return true;
+}
+
+// path of fm does not exist, watch its parent directory for creation
+static void set_missing(struct FMHandle *h, struct FM *fm)
+{
+        set_wd(h, fm, -1);
+        watch_parent(h, fm);
+
+        // the path may have been created before the parent was watched
+        if (!attach(h, fm)) {
+                update_schedule(h, fm);
+        }
+}
+
+// attach() of a missing fm just failed, try its parent, which may have
+// been created since
+static void retry_missing(struct FMHandle *h, struct FM *fm)
+{
+        const int dir = fm->dir;
+        watch_parent(h, fm);
+
+        // only a new parent watch may have missed the creation, a
+        // failed attach() is not repeated otherwise
+        if ((dir != fm->dir) && attach(h, fm)) return;
+        update_schedule(h, fm);
+}
+
+// all monitors of the inode of wd, return their number
+static int findWd(struct FMHandle *h, const int wd, int *slots)
+{
+        // IN_Q_OVERFLOW has wd -1, which is not a watch
+        if (0 > wd) return 0;
+
+        int n = 0;
+        FOR (h->monitors) {
+                if (wd == fm->wd) {slots[n++] = fm - h->monitors;}
+        }
+        return n;
+}
+
+// subscribers are only known by id
+static struct FM* findPath(struct FMHandle *h, const char* path)
+{
+        FOR (h->monitors) {
+                if (fm->path[0] && !fm->subscriber &&
+                    (0 == strncmp(path, fm->path, FM_PATH_MAX_LENGTH))) {
+                        return fm;
+                }
+        }
+
+        return NULL;
+}
+
+// fm has been written, or replaced
+static void update_now(struct FMHandle *h, struct FM *fm)
+{
+        // rewritten with the same content
+        if (!refresh(h, fm)) return;
+        fm->changed_ms = nowMs();
+
+        if (fm->flags & FM_TAIL) {
+                tailed(h, fm);
+                return;
+        }
+
+        bump_generation(h, fm);
+
+        if (h->dirty_mode) {
+                mark_dirty(h, fm);
+        }
+        else if (FM_UNMONITOR == notify(h, fm, fm->onUpdate)) {
+                remove_monitor(h, fm);
+        }
+}
+
+static void updated(struct FMHandle *h, struct FM *fm)
+{
+        if (!(fm->flags & FM_STAT_FILTER)) {
+                update_now(h, fm);
+        }
+        else {
+                // stat once for all events of the monitor, after the batch
+                if (0 == fm->stat_mask) {
+                        h->stat_batch[h->stat_batch_count++] = fm - h->monitors;
+                }
+                fm->stat_mask |= h->event.mask;
+        }
+}
+
+// the updates of FM_STAT_FILTER monitors queued during dispatch
+static void flush_stat_batch(struct FMHandle *h)
+{
+        const int n = h->stat_batch_count;
+        h->stat_batch_count = 0;
+
+        for (int i = 0; i < n; i++) {
+                struct FM *fm = &h->monitors[h->stat_batch[i]];
+                // removed, or seen already
+                if (0 == fm->stat_mask) continue;
+
+                const uint32_t mask = fm->stat_mask;
+                fm->stat_mask = 0;
+
+                struct FMStat old = fm->stat;
+                const int err = take_stat(fm->path, &fm->stat);
+                if ((ENOENT == err) || sameStat(&old, &fm->stat)) continue;
+
+                h->event.mask = mask;
+                h->event.cookie = 0;
+                h->event.name = "";
+                h->event.stat_old = &old;
+                h->event.stat_new = &fm->stat;
+                update_now(h, fm);
+                h->event.stat_old = NULL;
+                h->event.stat_new = NULL;
+        }
+}
+
+// the path of fm no longer refers to the watched file
+static void deleted(struct FMHandle *h, struct FM *fm)
+{
+        bump_generation(h, fm);
+
+        if (h->dirty_mode) {
+                mark_dirty(h, fm);
+        }
+        else if (FM_MONITOR != notify(h, fm, fm->onDelete)) {
+                remove_monitor(h, fm);
+                return;
+        }
+
+        // keep the path among monitors, the inode may be reused
+        set_snapshot(fm, NULL);
+        memset(&fm->tail, 0, sizeof(fm->tail));
+        release_wd(h, fm, fm->wd);
+        set_missing(h, fm);
+}
+
+// another file took the path of fm, move the watch to it
+static void replaced(struct FMHandle *h, struct FM *fm, bool notify)
+{
+        relink(h, fm);
+
+        const int wd = watch_file(h, fm, fm->path, fm->mask);
+        if ((0 > wd) || (wd == fm->wd)) return;
+
+        const int old_wd = fm->wd;
+        set_wd(h, fm, wd);
+        release_wd(h, fm, old_wd);
+
+        if (notify) {
+                updated(h, fm);
+        }
+}
+
+// an event on the name of a FM_DIR_SCOPED monitor
+static void handleScopedEvent(struct FMHandle *h, struct FM *fm, uint32_t mask)
+{
+        if (-1 == fm->wd) {
+                if (mask & (IN_CREATE | IN_MOVED_TO)) {
+                        attach(h, fm);
+                }
+        }
+        else if (mask & (IN_DELETE | IN_MOVED_FROM)) {
+                deleted(h, fm);
+        }
+        else if (mask & (IN_CLOSE_WRITE | IN_MOVED_TO | fm->mask)) {
+                updated(h, fm);
+        }
+}
+
+/*
+ * Matcher for patterns and ignore rules. Wildcards do not match a
+ * slash, which is matched literally.
+ */
+
+static bool globCompile(struct FMMatcher *m, const char *p)
+{
+        memset(m->classes, 0, sizeof(m->classes));
+        m->stars = 0;
+        m->dotfiles = ('.' == p[0]) || (('\\' == p[0]) && ('.' == p[1]));
+
+        int n = 0;
+        while (*p) {
+                if (63 <= n) return false;
+                const uint64_t bit = (uint64_t)1 << n;
+
+                if ('*' == *p) {
+                        // ** is the same as *
+                        while ('*' == *p) {++p;}
+                        for (int c = 1; c < 256; c++) {
+                                if ('/' != c) {m->classes[c] |= bit;}
+                        }
+                        m->stars |= bit;
+                }
+                else if ('?' == *p) {
+                        ++p;
+                        for (int c = 1; c < 256; c++) {
+                                if ('/' != c) {m->classes[c] |= bit;}
+                        }
+                }
+                else if (('[' == *p) && strchr(p + 1, ']')) {
+                        ++p;
+                        const bool negate = ('!' == *p) || ('^' == *p);
+                        if (negate) {++p;}
+
+                        bool set[256] = {false};
+                        // a ] first in the class is a member
+                        do {
+                                const unsigned char lo = *p++;
+                                unsigned char hi = lo;
+                                if (('-' == p[0]) && p[1] && (']' != p[1])) {
+                                        hi = p[1];
+                                        p += 2;
+                                }
+                                for (int c = lo; c <= hi; c++) {set[c] = true;}
+                        } while (*p && (']' != *p));
+                        if (*p) {++p;}
+
+                        for (int c = 1; c < 256; c++) {
+                                if ((set[c] != negate) && ('/' != c)) {m->classes[c] |= bit;}
+                        }
+                }
+                else {
+                        if (('\\' == *p) && p[1]) {++p;}
+                        m->classes[(unsigned char)*p++] |= bit;
+                }
+                ++n;
+        }
+
+        m->accept = (uint64_t)1 << n;
+        return 0 < n;
+}
+
+static uint64_t globClosure(const struct FMMatcher *m, uint64_t state)
+{
+        // no two stars follow each other, one step is enough
+        return state | ((state & m->stars) << 1);
+}
+
+static bool globMatch(const struct FMMatcher *m, const char *name)
+{
+        // hidden files need a literal dot
+        if (('.' == name[0]) && !m->dotfiles) return false;
+
+        uint64_t state = globClosure(m, 1);
+        for (const unsigned char *c = (const void *)name; *c && state; ++c) {
+                const uint64_t accepted = state & m->classes[*c];
+                state = globClosure(m, ((accepted & ~m->stars) << 1) |
+                                    (accepted & m->stars));
+        }
+        return state & m->accept;
+}
+
+/*
+ * Trees
+ *
+ * The directories of a tree are entries in the directory table with
+ * tree set, holding one reference. The initial walk is spread over
+ * FM_TREE_THREADS workers, each with a deque of directories to read.
+ * A worker pops from the bottom of its own deque and steals from the
+ * top of the others when it runs dry.
+ */
+
+// path below the root of t
+static const char *treeRel(const struct FMTree *t, const char *path)
+{
+        const size_t len = strlen(t->root);
+        path += len;
+        if (len && ('/' != t->root[len - 1]) && ('/' == *path)) {++path;}
+        return path;
+}
+
+// rel, or the names at its end for a rule that is not anchored
+static bool ignoreMatch(const struct FMIgnore *r, const char *rel)
+{
+        if (r->anchored) return globMatch(&r->match, rel);
+        if (!r->nested) return globMatch(&r->match, nameOf(rel));
+
+        for (const char *p = rel; p; p = strchr(p, '/')) {
+                if ('/' == *p) {++p;}
+                if (globMatch(&r->match, p)) return true;
+        }
+        return false;
+}
+
+// the last matching rule decides, as in gitignore
+static bool ignored(const struct FMHandle *h, const char *rel, bool is_dir)
+{
+        bool rv = false;
+        for (int i = 0; i < h->ignore_count; i++) {
+                const struct FMIgnore *r = &h->ignores[i];
+                if ((r->dir_only && !is_dir) || (rv != r->negate)) continue;
+
+                if (ignoreMatch(r, rel)) {
+                        rv = !r->negate;
+                }
+        }
+        return rv;
+}
+
+struct linux_dirent64 {
+        uint64_t d_ino;
+        int64_t d_off;
+        unsigned short d_reclen;
+        unsigned char d_type;
+        char d_name[];
+};
+
+// directories queued per worker, more are read depth first in place
+#define TREE_DEQUE 256
+
+struct TreeDeque {
+        pthread_mutex_t lock;
+        unsigned top;
+        unsigned bottom;
+        char items[TREE_DEQUE][FM_PATH_MAX_LENGTH];
+};
+
+struct TreeScan;
+
+struct TreeWorker {
+        struct TreeScan *scan;
+        pthread_t thread;
+        struct TreeDeque q;
+};
+
+struct TreeScan {
+        struct FMHandle *h;
+        int tree;
+        pthread_mutex_t lock; // directory table
+        int pending;          // directories queued or being read
+        int queued;           // directories in the deques
+        pthread_mutex_t idle_lock;
+        pthread_cond_t idle;  // workers without work wait here
+        int workers;
+        struct TreeWorker worker[FM_TREE_THREADS];
+};
+
+// wake a waiting worker, after new work or the end of the walk
+static void treeWake(struct TreeScan *scan, bool all)
+{
+        pthread_mutex_lock(&scan->idle_lock);
+        if (all) {
+                pthread_cond_broadcast(&scan->idle);
+        }
+        else {
+                pthread_cond_signal(&scan->idle);
+        }
+        pthread_mutex_unlock(&scan->idle_lock);
+}
+
+static bool treePush(struct TreeScan *scan, struct TreeDeque *q, const char *path)
+{
+        pthread_mutex_lock(&q->lock);
+        const bool room = (q->bottom - q->top) < TREE_DEQUE;
+        if (room) {
+                strcpy(q->items[q->bottom++ % TREE_DEQUE], path);
+        }
+        pthread_mutex_unlock(&q->lock);
+
+        if (room) {
+                __atomic_add_fetch(&scan->queued, 1, __ATOMIC_SEQ_CST);
+                treeWake(scan, false);
+        }
+        return room;
+}
+
+static bool treePop(struct TreeScan *scan, struct TreeDeque *q, char *path)
+{
+        pthread_mutex_lock(&q->lock);
+        const bool found = q->bottom != q->top;
+        if (found) {
+                strcpy(path, q->items[--q->bottom % TREE_DEQUE]);
+        }
+        pthread_mutex_unlock(&q->lock);
+
+        if (found) {__atomic_sub_fetch(&scan->queued, 1, __ATOMIC_SEQ_CST);}
+        return found;
+}
+
+static bool treeSteal(struct TreeScan *scan, struct TreeDeque *q, char *path)
+{
+        pthread_mutex_lock(&q->lock);
+        const bool found = q->bottom != q->top;
+        if (found) {
+                strcpy(path, q->items[q->top++ % TREE_DEQUE]);
+        }
+        pthread_mutex_unlock(&q->lock);
+
+        if (found) {__atomic_sub_fetch(&scan->queued, 1, __ATOMIC_SEQ_CST);}
+        return found;
+}
+
+// a directory is done, the walk with the last one
+static void treeDone(struct TreeScan *scan)
+{
+        if (0 == __atomic_sub_fetch(&scan->pending, 1, __ATOMIC_SEQ_CST)) {
+                treeWake(scan, true);
+        }
+}
+
+// enter a watched directory in the table, called with the scan lock
+static bool treeAddDir(struct FMHandle *h, int tree, const char *path, int wd)
+{
+        if (!index_wd(h, wd)) {
+                release_wd(h, NULL, wd);
+                return false;
+        }
+
+        struct FMDir *d = findDirWd(h, wd);
+        if (!d && !(d = alloc_dir(h, wd, path))) {
+                release_wd(h, NULL, wd);
+                return false;
+        }
+
+        // a directory belongs to one tree, the first one
+        if (-1 == d->tree) {
+                d->tree = tree;
+                d->fresh = true;
+                d->mask |= TREE_MASK;
+                ++d->refs;
+                ++h->trees[tree].dirs;
+        }
+        return true;
+}
+
+// watch and enter a tree directory; a wd new to the handle beyond the
+// watch budget demotes monitors to make room, or is given back
+static bool treeWatch(struct TreeScan *scan, const char *path)
+{
+        struct FMHandle *h = scan->h;
+        for (;;) {
+                const int wd = inotify_add_watch(h->inotify_fd, path, TREE_MASK | DIR_FLAGS);
+                const int err = errno;
+
+                bool added = false;
+                bool retry = false;
+                pthread_mutex_lock(&scan->lock);
+                if (0 <= wd) {
+                        bool room = useSlot(h, wd)->wd || (h->watches < h->watch_budget);
+                        while (!room && demote_one(h, NULL)) {
+                                room = h->watches < h->watch_budget;
+                        }
+                        if (room) {
+                                added = treeAddDir(h, scan->tree, path, wd);
+                        }
+                        else {
+                                release_wd(h, NULL, wd);
+                        }
+                }
+                else {
+                        retry = (ENOSPC == err) && demote_one(h, NULL);
+                }
+                pthread_mutex_unlock(&scan->lock);
+                if (!retry) return added;
+        }
+}
+
+static void treeReadDir(struct TreeWorker *w, const char *path)
+{
+        struct TreeScan *scan = w->scan;
+        struct FMHandle *h = scan->h;
+
+        const int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (0 > fd) return;
+
+        // watch before reading, subdirectories created after the read
+        // are reported with IN_CREATE
+        if (!treeWatch(scan, path)) {
+                __atomic_add_fetch(&h->trees[scan->tree].skipped, 1, __ATOMIC_RELAXED);
+                close(fd);
+                return;
+        }
+
+        const size_t len = strlen(path);
+        const char *sep = (len && ('/' == path[len - 1])) ? "" : "/";
+
+        char buf[8192] __attribute__((aligned(8)));
+        long n;
+        while (0 < (n = syscall(SYS_getdents64, fd, buf, sizeof(buf)))) {
+                for (long pos = 0; pos < n; ) {
+                        const struct linux_dirent64 *e = (void *)(buf + pos);
+                        pos += e->d_reclen;
+
+                        const char *name = e->d_name;
+                        if (('.' == name[0]) &&
+                            ((0 == name[1]) || (('.' == name[1]) && (0 == name[2])))) {
+                                continue;
+                        }
+
+                        bool is_dir = DT_DIR == e->d_type;
+                        if (DT_UNKNOWN == e->d_type) {
+                                struct stat st;
+                                is_dir = (0 == fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW)) &&
+                                        S_ISDIR(st.st_mode);
+                        }
+                        if (!is_dir) continue;
+
+                        char child[FM_PATH_MAX_LENGTH];
+                        if (sizeof(child) <= (size_t)snprintf(child, sizeof(child), "%s%s%s",
+                                                              path, sep, name)) {
+                                __atomic_add_fetch(&h->trees[scan->tree].skipped, 1,
+                                                   __ATOMIC_RELAXED);
+                                continue;
+                        }
+
+                        // the rules are only read while scanning
+                        if (ignored(h, treeRel(&h->trees[scan->tree], child), true)) {
+                                __atomic_add_fetch(&h->trees[scan->tree].ignored, 1,
+                                                   __ATOMIC_RELAXED);
+                                continue;
+                        }
+
+                        __atomic_add_fetch(&scan->pending, 1, __ATOMIC_SEQ_CST);
+                        if (!treePush(scan, &w->q, child)) {
+                                treeReadDir(w, child);
+                                treeDone(scan);
+                        }
+                }
+        }
+        close(fd);
+}
+
+static void *treeWorker(void *arg)
+{
+        struct TreeWorker *w = arg;
+        struct TreeScan *scan = w->scan;
+        char path[FM_PATH_MAX_LENGTH];
+
+        for (;;) {
+                bool found = treePop(scan, &w->q, path);
+                for (int i = 0; !found && (i < scan->workers); i++) {
+                        found = treeSteal(scan, &scan->worker[i].q, path);
+                }
+
+                if (found) {
+                        treeReadDir(w, path);
+                        treeDone(scan);
+                        continue;
+                }
+
+                // nothing to steal, wait for a push or the end; checked
+                // under the lock the wakeups are sent with
+                pthread_mutex_lock(&scan->idle_lock);
+                const bool done = 0 == __atomic_load_n(&scan->pending, __ATOMIC_SEQ_CST);
+                if (!done && (0 == __atomic_load_n(&scan->queued, __ATOMIC_SEQ_CST))) {
+                        pthread_cond_wait(&scan->idle, &scan->idle_lock);
+                }
+                pthread_mutex_unlock(&scan->idle_lock);
+                if (done) break;
+        }
+        return NULL;
+}
+
+// watch path and all directories below it, return false if out of memory
+static bool treeScan(struct FMHandle *h, int tree, const char *path, int workers)
+{
+        struct TreeScan *scan = calloc(1, sizeof(*scan));
+        if (!scan) return false;
+
+        scan->h = h;
+        scan->tree = tree;
+        scan->workers = (workers < 1) ? 1 :
+                (workers > FM_TREE_THREADS) ? FM_TREE_THREADS : workers;
+        pthread_mutex_init(&scan->lock, NULL);
+        pthread_mutex_init(&scan->idle_lock, NULL);
+        pthread_cond_init(&scan->idle, NULL);
+        for (int i = 0; i < scan->workers; i++) {
+                scan->worker[i].scan = scan;
+                pthread_mutex_init(&scan->worker[i].q.lock, NULL);
+        }
+
+        scan->pending = 1;
+        treePush(scan, &scan->worker[0].q, path);
+
+        // the calling thread is worker 0
+        int started = 1;
+        for (; started < scan->workers; started++) {
+                struct TreeWorker *w = &scan->worker[started];
+                if (pthread_create(&w->thread, NULL, treeWorker, w)) break;
+        }
+        treeWorker(&scan->worker[0]);
+        for (int i = 1; i < started; i++) {
+                pthread_join(scan->worker[i].thread, NULL);
+        }
+
+        for (int i = 0; i < scan->workers; i++) {
+                pthread_mutex_destroy(&scan->worker[i].q.lock);
+        }
+        pthread_cond_destroy(&scan->idle);
+        pthread_mutex_destroy(&scan->idle_lock);
+        pthread_mutex_destroy(&scan->lock);
+        free(scan);
+        return true;
+}
+
+static void release_tree_dir(struct FMHandle *h, struct FMDir *d)
+{
+        --h->trees[d->tree].dirs;
+        d->tree = -1;
+        d->fresh = false;
+        release_dir(h, d);
+}
+
+// stop watching path, and everything below it, as part of tree
+static void release_subtree(struct FMHandle *h, int tree, const char *path)
+{
+        const size_t len = strlen(path);
+
+        for (struct FMDir *d = h->dirs; d < h->dirs + FM_MAX_DIRS; ++d) {
+                if ((tree == d->tree) && (0 == strncmp(path, d->path, len)) &&
+                    ((0 == d->path[len]) || ('/' == d->path[len]))) {
+                        release_tree_dir(h, d);
+                }
+        }
+}
+
+static void remove_tree(struct FMHandle *h, int tree)
+{
+        for (struct FMDir *d = h->dirs; d < h->dirs + FM_MAX_DIRS; ++d) {
+                if (tree == d->tree) {
+                        release_tree_dir(h, d);
+                }
+        }
+        memset(&h->trees[tree], 0, sizeof(h->trees[tree]));
+}
+
+// call onWatchSetup for directories added since the last call
+static void treeSetupDone(struct FMHandle *h, int tree)
+{
+        for (struct FMDir *d = h->dirs; d < h->dirs + FM_MAX_DIRS; ++d) {
+                if ((tree != d->tree) || !d->fresh) continue;
+
+                d->fresh = false;
+                const struct FMTree *t = &h->trees[tree];
+                if (t->onWatchSetup &&
+                    (FM_UNMONITOR == t->onWatchSetup(h, d->path))) {
+                        remove_tree(h, tree);
+                        return;
+                }
+        }
+}
+
+static void handleTreeEvent(struct FMHandle *h, int tree, const char *dir,
+                            const struct inotify_event* event)
+{
+        char path[FM_PATH_MAX_LENGTH];
+        const size_t len = strlen(dir);
+        const char *sep = (len && ('/' == dir[len - 1])) ? "" : "/";
+        if (sizeof(path) <= (size_t)snprintf(path, sizeof(path), "%s%s%s",
+                                             dir, sep, event->name)) {
+                return;
+        }
+
+        struct FMTree *t = &h->trees[tree];
+        int rv = FM_OK;
+
+        // excluded directories are never watched, nothing to release
+        if (ignored(h, treeRel(t, path), event->mask & IN_ISDIR)) {
+                if ((event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO))) {
+                        ++t->ignored;
+                }
+                return;
+        }
+
+        if (event->mask & IN_ISDIR) {
+                if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+                        treeScan(h, tree, path, 1);
+                        treeSetupDone(h, tree);
+                        return;
+                }
+                if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                        release_subtree(h, tree, path);
+                }
+        }
+
+        if ((event->mask & (IN_DELETE | IN_MOVED_FROM)) && t->onDelete) {
+                rv = t->onDelete(h, path);
+        }
+        else if ((event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) && t->onUpdate) {
+                rv = t->onUpdate(h, path);
+        }
+
+        if (FM_UNMONITOR == rv) {
+                remove_tree(h, tree);
+        }
+}
+
+/*
+ * Patterns
+ */
+
+// split pattern at its last slash, return the name part or NULL
+static const char *globDir(const char *pattern, char *dir)
+{
+        const char *name = nameOf(pattern);
+        strcpy(dir, ".");
+        if (name != pattern) {
+                const size_t len = (name - 1 == pattern) ? 1 : name - 1 - pattern;
+                memcpy(dir, pattern, len);
+                dir[len] = 0;
+        }
+        return name[0] ? name : NULL;
+}
+
+static int globAdd(struct FMHandle *h, int glob, const char *path)
+{
+        if (findPath(h, path)) return 0;
+
+        const struct FMGlob *g = &h->globs[glob];
+        if (0 > FileMonitor_monitor(h, path, g->onWatchSetup, g->onUpdate,
+                                    g->onDelete)) {
+                return 0;
+        }
+
+        // onWatchSetup may have removed it
+        struct FM *fm = findPath(h, path);
+        if (!fm) return 0;
+        fm->glob = glob;
+        return 1;
+}
+
+// monitor the matching files already in the directory
+static int globScan(struct FMHandle *h, int glob)
+{
+        struct FMGlob *g = &h->globs[glob];
+        char dir[FM_PATH_MAX_LENGTH];
+        globDir(g->pattern, dir);
+
+        struct FMDir *d = acquire_dir(h, NULL, dir, GLOB_MASK);
+        if (!d) return 0;
+        ++d->refs;
+        g->dir = d - h->dirs;
+
+        DIR *dp = opendir(dir);
+        if (!dp) return 0;
+
+        int added = 0;
+        struct dirent *e;
+        while ((e = readdir(dp))) {
+                if (!globMatch(&g->match, e->d_name)) continue;
+
+                char path[FM_PATH_MAX_LENGTH];
+                if (sizeof(path) <= (size_t)snprintf(path, sizeof(path), "%s/%s",
+                                                     dir, e->d_name)) {
+                        continue;
+                }
+
+                struct stat st;
+                if ((DT_REG == e->d_type) ||
+                    ((DT_UNKNOWN == e->d_type) && (0 == stat(path, &st)) &&
+                     S_ISREG(st.st_mode))) {
+                        added += globAdd(h, glob, path);
+                }
+        }
+        closedir(dp);
+        return added;
+}
+
+static void remove_glob(struct FMHandle *h, int glob)
+{
+        FOR (h->monitors) {
+                if (glob == fm->glob) {
+                        remove_monitor(h, fm);
+                }
+        }
+
+        struct FMGlob *g = &h->globs[glob];
+        if (-1 != g->dir) {
+                release_dir(h, &h->dirs[g->dir]);
+        }
+        memset(g, 0, sizeof(*g));
+        g->dir = -1;
+}
+
+static void handleGlobEvent(struct FMHandle *h, int glob, const char *dir,
+                            const struct inotify_event* event)
+{
+        if (event->mask & IN_ISDIR) return;
+
+        char path[FM_PATH_MAX_LENGTH];
+        if (sizeof(path) <= (size_t)snprintf(path, sizeof(path), "%s/%s",
+                                             dir, event->name)) {
+                return;
+        }
+
+        if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+                globAdd(h, glob, path);
+                return;
+        }
+        if (!(event->mask & GLOB_MASK)) return;
+
+        // the watch of the file has reported the deletion already, or
+        // will only once the file is closed by everyone
+        struct FM *fm = findPath(h, path);
+        if (fm && (glob == fm->glob)) {
+                const FMOnDelete onDelete = (-1 == fm->wd) ? NULL : fm->onDelete;
+                remove_monitor(h, fm);
+                if (onDelete) {
+                        onDelete(h, path);
+                }
+        }
+}
+
+static void handleParentEvent(struct FMHandle *h,
+                              const struct inotify_event* event)
+{
+        struct FMDir *d = findDirWd(h, event->wd);
+        if (!d) return;
+
+        const int dir = d - h->dirs;
+
+        if (event->mask & IN_IGNORED) {
+                if (-1 != d->tree) {
+                        --h->trees[d->tree].dirs;
+                }
+
+                // the directory is gone, its monitors are left to
+                // reMonitorNonExistingPaths()
+                FOR (h->monitors) {
+                        if (dir == fm->dir) {
+                                fm->dir = -1;
+                                fm->dir_next = -1;
+                                update_schedule(h, fm);
+                        }
+                }
+                for (int i = 0; i < FM_MAX_LINK_MONITORS; i++) {
+                        struct FMLinkChain *c = &h->chains[i];
+                        for (int l = 0; l < c->count; l++) {
+                                if (dir == c->links[l].dir) {
+                                        c->links[l].dir = -1;
+                                }
+                        }
+                }
+                for (int i = 0; i < FM_MAX_GLOBS; i++) {
+                        if (dir == h->globs[i].dir) {
+                                h->globs[i].dir = -1;
+                        }
+                }
+                free_dir(h, d);
+                return;
+        }
+
+        // callbacks may release the directory
+        const int tree = d->tree;
+        char dir_path[FM_PATH_MAX_LENGTH];
+        strcpy(dir_path, d->path);
+
+        int glob_matches[FM_MAX_GLOBS];
+        int globs = 0;
+        for (int i = 0; i < FM_MAX_GLOBS; i++) {
+                if ((dir == h->globs[i].dir) && globMatch(&h->globs[i].match, event->name)) {
+                        glob_matches[globs++] = i;
+                }
+        }
+
+        // collect first, onWatchSetup may change the directory
+        int matches[FM_MAX_MONITORS];
+        int n = 0;
+        const uint32_t hash = hashName(event->name);
+        for (int slot = d->buckets[hash & (FM_DIR_BUCKETS - 1)];
+             -1 != slot;
+             slot = h->monitors[slot].dir_next) {
+
+                const struct FM *fm = &h->monitors[slot];
+                if ((hash == fm->name_hash) &&
+                    (0 == strcmp(event->name, nameOf(fm->path)))) {
+                        matches[n++] = slot;
+                }
+        }
+
+        // symlinks on the way to a monitored path
+        int link_matches[FM_MAX_LINK_MONITORS];
+        int links = 0;
+        for (int i = 0; i < FM_MAX_LINK_MONITORS; i++) {
+                const struct FMLinkChain *c = &h->chains[i];
+                for (int l = 0; (-1 != c->fm) && (l < c->count); l++) {
+                        const struct FMLink *link = &c->links[l];
+                        if ((dir == link->dir) && (hash == link->name_hash) &&
+                            (0 == strcmp(event->name, nameOf(link->path)))) {
+                                link_matches[links++] = c->fm;
+                                break;
+                        }
+                }
+        }
+
+        for (int i = 0; i < n; i++) {
+                struct FM *fm = &h->monitors[matches[i]];
+                if (dir != fm->dir) continue;
+
+                if (fm->flags & FM_DIR_SCOPED) {
+                        handleScopedEvent(h, fm, event->mask);
+                }
+                else if (!(event->mask & (IN_CREATE | IN_MOVED_TO))) {
+                        // reported by the watch of the file
+                }
+                else if (-1 == fm->wd) {
+                        attach(h, fm);
+                }
+                else {
+                        // a file created in place will be closed after
+                        // writing, a file renamed in place is complete
+                        replaced(h, fm, event->mask & IN_MOVED_TO);
+                }
+        }
+
+        for (int i = 0; i < links; i++) {
+                struct FM *fm = &h->monitors[link_matches[i]];
+                if (!(fm->flags & FM_FOLLOW_LINKS) ||
+                    !(event->mask & (IN_CREATE | IN_MOVED_TO))) continue;
+
+                // a swapped link points to a complete file
+                if (-1 == fm->wd) {
+                        attach(h, fm);
+                }
+                else {
+                        replaced(h, fm, true);
+                }
+        }
+
+        // monitors of the name above have taken care of replacements
+        for (int i = 0; i < globs; i++) {
+                if (h->globs[glob_matches[i]].pattern[0]) {
+                        handleGlobEvent(h, glob_matches[i], dir_path, event);
+                }
+        }
+
+        if ((-1 != tree) && h->trees[tree].root[0]) {
+                handleTreeEvent(h, tree, dir_path, event);
+        }
+}
+
+static void handleEvent(struct FMHandle *h, const struct inotify_event* event)
+{
+        // named events come from directory watches only
+        if ((event->mask & IN_IGNORED) || event->len) {
+                handleParentEvent(h, event);
+        }
+
+        // collect first, callbacks may change the monitors
+        int slots[FM_MAX_MONITORS];
+        const int n = findWd(h, event->wd, slots);
+        for (int i = 0; i < n; i++) {
+                struct FM *fm = &h->monitors[slots[i]];
+                if (event->wd != fm->wd) continue;
+#ifdef DEBUG
+                printf("%s"NL, fm->path);
+                if (event->mask & IN_ACCESS) {printf(" IN_ACCESS" NL);}
+                else if (event->mask & IN_ATTRIB) {printf(" IN_ATTRIB" NL);}
+                else if (event->mask & IN_CLOSE_WRITE) {printf(" CLOSE_WRITE" NL);}
+                else if (event->mask & IN_CLOSE_NOWRITE) {printf(" IN_CLOSE_NOWRITE" NL);}
+                else if (event->mask & IN_CREATE) {printf(" IN_CREATE" NL);}
+                else if (event->mask & IN_DELETE) {printf(" IN_DELETE" NL);}
+                else if (event->mask & IN_DELETE_SELF) {printf(" IN_DELETE_SELF" NL);}
+                else if (event->mask & IN_MODIFY) {printf(" IN_MODIFY" NL);}
+                else if (event->mask & IN_MOVE_SELF) {printf(" IN_MOVE_SELF" NL);}
+                else if (event->mask & IN_MOVED_FROM) {printf(" IN_MOVED_FROM" NL);}
+                else if (event->mask & IN_MOVED_TO) {printf(" IN_MOVED_TO" NL);}
+                else if (event->mask & IN_OPEN) {printf(" IN_OPEN" NL);}
+#endif
+
+                // a moved file is no longer at the monitored path
+                if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+                        deleted(h, fm);
+                }
+                else if (event->mask & (IN_CLOSE_WRITE | fm->mask)) {
+                        updated(h, fm);
+                }
+        }
+}
+
+static void init_handle(struct FMHandle *h)
+{
+        // we can not know if h is already initialized or just not
+        // zero-initialized => scrap the hole thing
+        memset(h, 0, sizeof(*h));
+
+        FOR(h->monitors) {
+                fm->wd = -1;
+                fm->dir = -1;
+                fm->dir_next = -1;
+                fm->heap_pos = -1;
+                fm->pending_prev = -1;
+                fm->pending_next = -1;
+                fm->lazy_prev = -1;
+                fm->lazy_next = -1;
+                fm->fan_bucket = -1;
+                fm->fan_next = -1;
+                fm->chain = -1;
+                fm->glob = -1;
+        }
+        for (int i = 0; i < FM_FAN_BUCKETS; i++) {h->fan_buckets[i] = -1;}
+        for (int i = 0; i < FM_MAX_LINK_MONITORS; i++) {h->chains[i].fm = -1;}
+        for (int i = 0; i < FM_MAX_GLOBS; i++) {h->globs[i].dir = -1;}
+        h->fanotify_fd = -1;
+        h->watch_budget = kernelWatchLimit();
+        h->pending_head = -1;
+        h->lazy_head = -1;
+        h->lazy_tail = -1;
+        h->event.name = "";
+        h->retry_seed = (uint32_t)nowMs() | 1;
+        h->dir_free = -1;
+        for (int i = FM_MAX_DIRS - 1; i >= 0; i--) {
+                clear_dir(&h->dirs[i]);
+                h->dirs[i].free_next = h->dir_free;
+                h->dir_free = i;
+        }
+}
+
+// release what h holds besides its watches, before init_handle()
+static void release_handle(struct FMHandle *h)
+{
+        FOR (h->monitors) {
+                if (fm->snapshot) {FileMonitor_snapshotRelease(fm->snapshot);}
+        }
+        if (0 <= h->fanotify_fd) {close(h->fanotify_fd);}
+        free(h->tail_buf);
+}
+
+int FileMonitor_init(struct FMHandle *h)
+{
+        if (!h) return -1;
+
+        init_handle(h);
+        h->inotify_fd = inotify_init1(IN_NONBLOCK);
+
+        return h->inotify_fd;
+}
+
+int FileMonitor_instanceInit(struct FMInstance *inst)
+{
+        if (!inst) return -1;
+
+        memset(inst, 0, sizeof(*inst));
+        inst->inotify_fd = inotify_init1(IN_NONBLOCK);
+
+        return inst->inotify_fd;
+}
+
+void FileMonitor_instanceClose(struct FMInstance *inst)
+{
+        if (!inst) return;
+
+        for (int i = 0; i < FM_MAX_GROUPS; i++) {
+                struct FMHandle *h = inst->handles[i];
+                if (h) {
+                        release_handle(h);
+                        init_handle(h);
+                        h->inotify_fd = -1;
+                        inst->handles[i] = NULL;
+                }
+        }
+        if (0 <= inst->inotify_fd) {
+                close(inst->inotify_fd);
+        }
+        memset(inst, 0, sizeof(*inst));
+        inst->inotify_fd = -1;
+}
+
+int FileMonitor_initShared(struct FMHandle *h, struct FMInstance *inst)
+{
+        if (!h || !inst || (0 > inst->inotify_fd)) return -1;
+
+        int group = -1;
+        for (int i = 0; (-1 == group) && (i < FM_MAX_GROUPS); i++) {
+                if (!inst->handles[i]) {group = i;}
+        }
+        if (-1 == group) return -1;
+
+        init_handle(h);
+        h->inotify_fd = inst->inotify_fd;
+        h->instance = inst;
+        h->group = group;
+        inst->handles[group] = h;
+
+        return h->inotify_fd;
+}
+
+void FileMonitor_leaveShared(struct FMHandle *h)
+{
+        if (!h || !h->instance) return;
+
+        struct FMInstance *inst = h->instance;
+        const uint64_t bit = (uint64_t)1 << h->group;
+
+        // watches used by this handle only
+        for (int i = 0; i < FM_INSTANCE_WDS; i++) {
+                struct FMWdEntry *e = &inst->wds[i];
+                if (!(e->handles & bit)) continue;
+
+                e->handles &= ~bit;
+                if (!e->handles) {
+                        const int wd = e->wd;
+                        wdRemove(inst, wd);
+                        inotify_rm_watch(inst->inotify_fd, wd);
+                        // an entry was shifted into i
+                        --i;
+                }
+        }
+
+        release_handle(h);
+        inst->handles[h->group] = NULL;
+        init_handle(h);
+        h->inotify_fd = -1;
+}
+
+void FileMonitor_close(struct FMHandle *h)
+{
+        if (!h) return;
+
+        if (h->instance) {
+                FileMonitor_leaveShared(h);
+                return;
+        }
+
+        release_handle(h);
+        if (0 <= h->inotify_fd) {close(h->inotify_fd);}
+        init_handle(h);
+        h->inotify_fd = -1;
+}
+
+int FileMonitor_monitor(struct FMHandle *h, const char *path,
+                        FMOnWatchSetup onWatchSetup, FMOnUpdate onUpdate,
+                        FMOnDelete onDelete)
+{
+        return FileMonitor_monitorWith(h, path, NULL,
+                                       onWatchSetup, onUpdate, onDelete);
+}
+
+/*
+ * Monitor path in the slot already monitoring it, or a new one for a
+ * subscriber. id is set to the slot.
+ */
+static int add_monitor(struct FMHandle *h, const char *path,
+                       const struct FMOptions *opt,
+                       FMOnWatchSetup onWatchSetup, FMOnUpdate onUpdate,
+                       FMOnDelete onDelete, bool subscriber, int *id)
+{
+        int rv = -1;
+
+        if (!h || (0 > h->inotify_fd)) return -1;
+        if (h->count >= FM_MAX_MONITORS) return -1;
+        if (!path) return -1;
+
+        enum FMBackendKind backend = opt ? opt->backend : FM_BACKEND_INOTIFY;
+        if ((0 > (int)backend) || (FM_BACKENDS <= backend)) return -1;
+
+        // the window of tailed bytes, only for handles that tail
+        if (opt && (opt->flags & FM_TAIL) && !h->tail_buf &&
+            !(h->tail_buf = malloc(FM_TAIL_WINDOW))) return -1;
+
+        const bool scoped = opt && (opt->flags & FM_DIR_SCOPED) &&
+                (FM_BACKEND_INOTIFY == backend);
+        const uint32_t mask = opt ? ((opt->mask & IN_ALL_EVENTS) |
+                                     ((opt->flags & FM_TAIL) ? IN_MODIFY : 0)) : 0;
+        // new paths are only recorded in lazy mode
+        const bool lazy = h->lazy_mode && !subscriber && !findPath(h, path);
+        struct FMStat registered = {0};
+        int wd = lazy ? FM_WD_LAZY :
+                scoped ? (access(path, F_OK) ? -1 : FM_WD_SCOPED) :
+                watch_with(h, subscriber ? NULL : findPath(h, path), path, mask,
+                           &backend);
+
+        if (-1 == wd) {
+                if (errno == ENOENT) {
+                        // indicate that path is not monitored
+                        rv = 0;
+                }
+        }
+        else {
+                rv = 1;
+        }
+        if (lazy && (0 != take_stat(path, &registered))) {
+                rv = 0;
+        }
+
+        if (-1 != rv) {
+                // check if its a known path
+                bool found_existing = false;
+                struct FM *new_fm = NULL;
+                FOR (h->monitors) {
+                        if (0 == fm->path[0]) {
+                                new_fm = fm;
+                        }
+                        else if (!subscriber && !fm->subscriber &&
+                                 (0 == strcmp(path, fm->path))) {
+                                new_fm = fm;
+                                found_existing = true;
+                                break;
+                        }
+                }
+                if (!found_existing) {++h->count;}
+                if (id) {*id = new_fm - h->monitors;}
+                else if (new_fm->wd != wd) {
+                        release_wd(h, new_fm, new_fm->wd);
+                }
+
+                set_wd(h, new_fm, wd);
+                new_fm->onWatchSetup = onWatchSetup;
+                new_fm->onUpdate = onUpdate;
+                new_fm->onDelete = onDelete;
+                new_fm->onEvent = opt ? opt->onEvent : NULL;
+                new_fm->context = opt ? opt->context : NULL;
+                new_fm->subscriber = subscriber;
+                strncpy(new_fm->path, path, FM_PATH_MAX_LENGTH-1);
+                new_fm->name_hash = hashName(nameOf(new_fm->path));
+                if (FM_BACKEND_FANOTIFY == backend) {fan_index(h, new_fm);}
+                new_fm->flags = opt ? opt->flags : 0;
+                if (!scoped) {new_fm->flags &= ~FM_DIR_SCOPED;}
+                new_fm->mask = mask;
+                new_fm->backend = backend;
+                new_fm->demoted = (FM_BACKEND_POLL == backend) &&
+                        (!opt || (FM_BACKEND_POLL != opt->backend));
+                new_fm->changed_ms = nowMs();
+                if ((new_fm->flags & FM_TAIL) && !found_existing) {
+                        tail_start(new_fm);
+                }
+                if (lazy) {
+                        // compared when the watch is setup
+                        new_fm->stat = registered;
+                        return rv;
+                }
+
+                if (new_fm->flags & FM_FOLLOW_LINKS) {
+                        relink(h, new_fm);
+                }
+                else {
+                        release_chain(h, new_fm);
+                }
+
+                if (-1 == wd) {
+                        set_missing(h, new_fm);
+                }
+                else {
+                        watch_parent(h, new_fm);
+
+                        if (scoped && (-1 == new_fm->dir)) {
+                                // no directory watch, nothing would be reported
+                                set_missing(h, new_fm);
+                        }
+                        else {
+                                if ((new_fm->flags & FM_STAT_FILTER) ||
+                                    (FM_BACKEND_POLL == backend)) {
+                                        take_stat(new_fm->path, &new_fm->stat);
+                                }
+                                refresh(h, new_fm);
+                                if (onWatchSetup &&
+                                    (FM_UNMONITOR == onWatchSetup(h, new_fm->path))) {
+                                        remove_monitor(h, new_fm);
+                                }
+                        }
+                }
+        }
+        return rv;
+}
+
+int FileMonitor_monitorWith(struct FMHandle *h, const char *path,
+                            const struct FMOptions *opt,
+                            FMOnWatchSetup onWatchSetup, FMOnUpdate onUpdate,
+                            FMOnDelete onDelete)
+{
+        return add_monitor(h, path, opt, onWatchSetup, onUpdate, onDelete,
+                           false, NULL);
+}
+
+int FileMonitor_subscribe(struct FMHandle *h, const char *path,
+                          const struct FMOptions *opt,
+                          FMOnWatchSetup onWatchSetup, FMOnUpdate onUpdate,
+                          FMOnDelete onDelete)
+{
+        int id = -1;
+        if (0 > add_monitor(h, path, opt, onWatchSetup, onUpdate, onDelete,
+                            true, &id)) {
+                return -1;
+        }
+        return id;
+}
+
+int FileMonitor_unsubscribe(struct FMHandle *h, int id)
+{
+        if (!h || (0 > h->inotify_fd) || (0 > id) || (FM_MAX_MONITORS <= id)) return -1;
+
+        struct FM *fm = &h->monitors[id];
+        if (!fm->path[0] || !fm->subscriber) return 0;
+
+        // the kernel watch goes with the last monitor using it
+        remove_monitor(h, fm);
+        return 1;
+}
+
+int FileMonitor_unMonitor(struct FMHandle *h, const char *path)
+{
+        int rv = -1;
+
+        if (!h || (0 > h->inotify_fd) || !path) return rv;
+
+        rv = 0;
+        struct FM *fm = findPath(h, path);
+        if (fm) {
+                remove_monitor(h, fm);
+                rv = 1;
+        }
+        return rv;
+}
+
+static uint64_t nowNs(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void dispatchEvent(struct FMHandle *h, const struct inotify_event *event)
+{
+        h->event.mask = event->mask;
+        h->event.cookie = event->cookie;
+        h->event.name = event->len ? event->name : "";
+        handleEvent(h, event);
+}
+
+static void dispatchDone(struct FMHandle *h)
+{
+        flush_stat_batch(h);
+        h->event.name = "";
+}
+
+void FileMonitor_instanceDispatch(struct FMInstance *inst)
+{
+        if (!inst || (0 > inst->inotify_fd)) return;
+
+        struct inotify_event *event = NULL;
+        char buf[4096]
+                __attribute__((aligned(__alignof__(struct inotify_event))));
+
+        const int numRead = read(inst->inotify_fd, buf, sizeof(buf));
+        const uint64_t received_ns = nowNs();
+
+        uint64_t touched = 0;
+        for (char *p = buf; p < buf + numRead; p += sizeof(*event) + event->len) {
+                event = (struct inotify_event *)p;
+
+                // every handle may have lost events
+                const uint64_t handles = (event->mask & IN_Q_OVERFLOW) ?
+                        ~(uint64_t)0 : wdHandles(inst, event->wd);
+                if (event->mask & IN_IGNORED) {
+                        wdRemove(inst, event->wd);
+                }
+
+                for (int i = 0; i < FM_MAX_GROUPS; i++) {
+                        struct FMHandle *h = inst->handles[i];
+                        if (!h || !(handles & ((uint64_t)1 << i))) continue;
+
+                        if (!(touched & ((uint64_t)1 << i))) {
+                                h->event.received_ns = received_ns;
+                                touched |= (uint64_t)1 << i;
+                        }
+                        dispatchEvent(h, event);
+                }
+        }
+
+        for (int i = 0; i < FM_MAX_GROUPS; i++) {
+                if (inst->handles[i] && (touched & ((uint64_t)1 << i))) {
+                        dispatchDone(inst->handles[i]);
+                }
+        }
+}
+
+// an event of a marked filesystem, on name in the directory fh
+static void handleFanEvent(struct FMHandle *h, uint64_t fsid,
+                           const struct file_handle *fh, const char *name,
+                           uint64_t mask)
+{
+        // collect first, callbacks may change the monitors
+        int slots[FM_MAX_MONITORS];
+        int n = 0;
+        const uint32_t hash = hashName(name);
+        const int bucket = fanBucket(fsid, fh->f_handle, fh->handle_bytes, hash);
+        for (int slot = h->fan_buckets[bucket]; -1 != slot;
+             slot = h->monitors[slot].fan_next) {
+                const struct FM *fm = &h->monitors[slot];
+                const struct FMFid *p = &fm->parent;
+                if ((FM_BACKEND_FANOTIFY == fm->backend) && (hash == fm->name_hash) &&
+                    p->bytes && (fsid == p->fsid) && (fh->handle_type == p->type) &&
+                    (fh->handle_bytes == p->bytes) &&
+                    (0 == memcmp(fh->f_handle, p->handle, p->bytes)) &&
+                    (0 == strcmp(name, nameOf(fm->path)))) {
+                        slots[n++] = fm - h->monitors;
+                }
+        }
+
+        // merged events in the order they happened
+        for (int i = 0; i < n; i++) {
+                struct FM *fm = &h->monitors[slots[i]];
+
+                if (mask & (FAN_CREATE | FAN_MOVED_TO)) {
+                        h->event.mask = (mask & FAN_CREATE) ? IN_CREATE : IN_MOVED_TO;
+                        if (-1 == fm->wd) {
+                                attach(h, fm);
+                        }
+                        else if (mask & FAN_MOVED_TO) {
+                                // a file renamed in place is complete
+                                updated(h, fm);
+                        }
+                }
+                if ((mask & (FAN_CLOSE_WRITE | FAN_MODIFY)) &&
+                    (FM_BACKEND_FANOTIFY == fm->backend) && (-1 != fm->wd)) {
+                        h->event.mask = (mask & FAN_CLOSE_WRITE) ? IN_CLOSE_WRITE : IN_MODIFY;
+                        if (h->event.mask & (IN_CLOSE_WRITE | fm->mask)) {
+                                updated(h, fm);
+                        }
+                }
+                if ((mask & (FAN_DELETE | FAN_MOVED_FROM)) &&
+                    (FM_BACKEND_FANOTIFY == fm->backend) && (-1 != fm->wd)) {
+                        h->event.mask = (mask & FAN_DELETE) ? IN_DELETE_SELF : IN_MOVE_SELF;
+                        deleted(h, fm);
+                }
+        }
+}
+
+static void fanDispatch(struct FMHandle *h)
+{
+        if (0 > h->fanotify_fd) return;
+
+        char buf[4096]
+                __attribute__((aligned(__alignof__(struct fanotify_event_metadata))));
+
+        ssize_t len = read(h->fanotify_fd, buf, sizeof(buf));
+        if (0 >= len) return;
+        h->event.received_ns = nowNs();
+        h->event.cookie = 0;
+        h->event.name = "";
+
+        for (const struct fanotify_event_metadata *md = (void *)buf;
+             FAN_EVENT_OK(md, len);
+             md = FAN_EVENT_NEXT(md, len)) {
+
+                const struct fanotify_event_info_fid *info = (const void *)(md + 1);
+                if ((md->event_len < sizeof(*md) + sizeof(*info)) ||
+                    (FAN_EVENT_INFO_TYPE_DFID_NAME != info->hdr.info_type)) continue;
+
+                const struct file_handle *fh = (const void *)info->handle;
+                uint64_t fsid;
+                memcpy(&fsid, &info->fsid, sizeof(fsid));
+                handleFanEvent(h, fsid, fh, (const char *)fh->f_handle + fh->handle_bytes,
+                               md->mask);
+        }
+        dispatchDone(h);
+}
+
+static void inotifyDispatch(struct FMHandle *h)
+{
+        // one read for all handles of the instance
+        if (h->instance) {
+                FileMonitor_instanceDispatch(h->instance);
+                return;
+        }
+
+        // FIONREAD should return the number of bytes to read from the
+        // inotify_fd. Can this be used here to deplete the events
+        // instead of relying on the external select? man ioctl(2)
+        struct inotify_event *event = NULL;
+        // room for at least one event with a NAME_MAX long name
+        char buf[4096]
+                __attribute__((aligned(__alignof__(struct inotify_event))));
+        char *next_event_ptr = NULL;
+
+        const int numRead = read(h->inotify_fd, buf, sizeof(buf));
+        h->event.received_ns = nowNs();
+
+        for (next_event_ptr = buf;
+             next_event_ptr < buf + numRead;
+             next_event_ptr += sizeof(*event) + event->len) {
+
+                event = (struct inotify_event *)next_event_ptr;
+                dispatchEvent(h, event);
+        }
+        dispatchDone(h);
+}
+
+// stat a FM_BACKEND_POLL monitor and call its callback if it changed
+static bool pollMonitor(struct FMHandle *h, struct FM *fm)
+{
+        struct FMStat old = fm->stat;
+        const int err = take_stat(fm->path, &fm->stat);
+        if (ENOENT == err) {
+                h->event.mask = IN_DELETE_SELF;
+                deleted(h, fm);
+                return true;
+        }
+
+        // a write in the tick of the last stat shows with the next
+        // change only, polling can not tell
+        if (err || ((old.size == fm->stat.size) && (old.ino == fm->stat.ino) &&
+                    (old.mtime_ns == fm->stat.mtime_ns) &&
+                    (old.ctime_ns == fm->stat.ctime_ns))) {
+                return false;
+        }
+
+        h->event.mask = IN_MODIFY;
+        h->event.stat_old = &old;
+        h->event.stat_new = &fm->stat;
+        update_now(h, fm);
+        h->event.stat_old = NULL;
+        h->event.stat_new = NULL;
+
+        if (fm->path[0] && fm->demoted) {promote(h, fm);}
+        return true;
+}
+
+static const struct Backend backends[FM_BACKENDS] = {
+        [FM_BACKEND_INOTIFY] = {
+                .watch = watch_file,
+                .release = inotify_release,
+                .dispatch = inotifyDispatch,
+                .parent = true,
+        },
+        [FM_BACKEND_POLL] = {
+                .watch = watch_poll,
+                .poll = pollMonitor,
+        },
+        [FM_BACKEND_FANOTIFY] = {
+                .watch = watch_fanotify,
+                .release = fan_release,
+                .dispatch = fanDispatch,
+        },
+};
+
+void FileMonitor_dispatch(struct FMHandle *h)
+{
+        // read even without monitors, IN_IGNORED from unMonitor() would
+        // otherwise keep the fd readable
+        if (!h || (0 > h->inotify_fd)) return;
+
+        for (int i = 0; i < FM_BACKENDS; i++) {
+                if (backends[i].dispatch) {backends[i].dispatch(h);}
+        }
+}
+
+int FileMonitor_nonExistingPaths(const struct FMHandle *h)
+{
+        if (!h || (0 > h->inotify_fd)) return -1;
+
+        return h->pending_count;
+}
+
+void FileMonitor_reMonitorNonExistingPaths(struct FMHandle *h)
+{
+        if (!h || (0 > h->inotify_fd) || h->count == 0) return;
+
+        // take the slots first, onWatchSetup may change the list
+        int slots[FM_MAX_MONITORS];
+        int n = 0;
+        for (int slot = h->pending_head; -1 != slot;
+             slot = h->monitors[slot].pending_next) {
+                slots[n++] = slot;
+        }
+
+        for (int i = 0; i < n; i++) {
+                struct FM *fm = &h->monitors[slots[i]];
+                if (fm->pending && !attach(h, fm) && (-1 == fm->dir)) {
+                        retry_missing(h, fm);
+                }
+        }
+
+        for (int i = 0; i < FM_MAX_GLOBS; i++) {
+                if (h->globs[i].pattern[0] && (-1 == h->globs[i].dir)) {
+                        globScan(h, i);
+                }
+        }
+}
+
+bool FileMonitor_isMonitored(struct FMHandle *h, const char* path)
+{
+        if (!h || !path) return false;
+
+        // as unMonitor() sees it, subscribers are only known by id
+        return NULL != findPath(h, path);
+}
+
+const struct FM * FileMonitor_next(const struct FMHandle *h, const struct FM *fm)
+{
+        if (!h) return NULL;
+
+        const struct FM* start = (NULL == fm) ? &h->monitors[0] : ++fm;
+
+        while (start != &h->monitors[FM_MAX_MONITORS]) {
+                if (0 != start->path[0]) {
+                        return start;
+                }
+                ++start;
+        }
+        return NULL;
+}
+
+int FileMonitor_id(struct FMHandle *h, const char *path)
+{
+        if (!h || !path) return -1;
+
+        const struct FM *fm = findPath(h, path);
+        return fm ? (int)(fm - h->monitors) : -1;
+}
+
+uint64_t FileMonitor_generation(const struct FMHandle *h, int id)
+{
+        if (!h || (0 > id) || (id >= FM_MAX_MONITORS)) return 0;
+
+        return __atomic_load_n(&h->generations[id], __ATOMIC_ACQUIRE);
+}
+
+// setup the watch of a lazily added monitor, report what changed since
+static void setup_lazy(struct FMHandle *h, struct FM *fm)
+{
+        const struct FMStat registered = fm->stat;
+
+        // watch first, changes after the stat below are seen by the watch
+        set_missing(h, fm);
+        if (!fm->path[0]) return;
+
+        struct FMStat now;
+        take_stat(fm->path, &now);
+
+        h->event.received_ns = nowNs();
+        h->event.cookie = 0;
+        h->event.name = "";
+        h->event.stat_old = &registered;
+        h->event.stat_new = &now;
+        if (-1 == fm->wd) {
+                if (registered.valid) {
+                        h->event.mask = IN_DELETE_SELF;
+                        deleted(h, fm);
+                }
+        }
+        else if (!registered.valid || !sameStat(&registered, &now)) {
+                // created or written meanwhile, or too recent to tell
+                h->event.mask = IN_CLOSE_WRITE;
+                update_now(h, fm);
+        }
+        h->event.stat_old = NULL;
+        h->event.stat_new = NULL;
+}
+
+void FileMonitor_setLazyMode(struct FMHandle *h, bool enable)
+{
+        if (!h) return;
+
+        h->lazy_mode = enable;
+}
+
+int FileMonitor_setupLazy(struct FMHandle *h, int max)
+{
+        if (!h || (0 > h->inotify_fd)) return -1;
+
+        // in the order they were added, setup takes each off the list
+        for (int done = 0; (-1 != h->lazy_head) && ((0 >= max) || (done < max)); done++) {
+                setup_lazy(h, &h->monitors[h->lazy_head]);
+        }
+        return h->lazy_count;
+}
+
+void FileMonitor_setDirtyMode(struct FMHandle *h, bool enable)
+{
+        if (!h) return;
+
+        h->dirty_mode = enable;
+}
+
+int FileMonitor_takeDirty(struct FMHandle *h, int *ids, int max)
+{
+        if (!h || !ids) return -1;
+
+        int n = 0;
+        for (int w = 0; (w < FM_DIRTY_WORDS) && (n < max); ++w) {
+                // skip clean words without a read-modify-write
+                if (0 == __atomic_load_n(&h->dirty[w], __ATOMIC_RELAXED)) {
+                        continue;
+                }
+
+                uint64_t bits = __atomic_exchange_n(&h->dirty[w], 0,
+                                                    __ATOMIC_ACQ_REL);
+                while (bits && (n < max)) {
+                        ids[n++] = w * 64 + __builtin_ctzll(bits);
+                        bits &= bits - 1;
+                }
+
+                if (bits) {
+                        // ids is full, hand the rest back
+                        __atomic_fetch_or(&h->dirty[w], bits,
+                                          __ATOMIC_RELEASE);
+                }
+        }
+        return n;
+}
+
+int FileMonitor_reMonitorScheduled(struct FMHandle *h)
+{
+        if (!h || (0 > h->inotify_fd)) return -1;
+
+        const uint64_t now = nowMs();
+
+        while (h->retry_count &&
+               (h->monitors[h->retry_heap[0]].retry_at_ms <= now)) {
+
+                struct FM *fm = &h->monitors[h->retry_heap[0]];
+
+                // back off first, attach() may remove fm
+                fm->retry_delay_ms *= 2;
+                if (fm->retry_delay_ms > FM_RETRY_MAX_MS) {
+                        fm->retry_delay_ms = FM_RETRY_MAX_MS;
+                }
+                retryAfter(h, fm, now);
+                retrySift(h, 0);
+
+                if (!attach(h, fm)) {
+                        retry_missing(h, fm);
+                }
+        }
+
+        if (0 == h->retry_count) return -1;
+
+        return h->monitors[h->retry_heap[0]].retry_at_ms - now;
+}
+
+int FileMonitor_monitorTree(struct FMHandle *h, const char *root,
+                            FMOnWatchSetup onWatchSetup, FMOnUpdate onUpdate,
+                            FMOnDelete onDelete)
+{
+        if (!h || (0 > h->inotify_fd) || !root || !root[0]) return -1;
+        if (FM_PATH_MAX_LENGTH <= strlen(root)) return -1;
+
+        struct stat st;
+        if ((0 != stat(root, &st)) || !S_ISDIR(st.st_mode)) return 0;
+
+        int tree = -1;
+        for (int i = 0; i < FM_MAX_TREES; i++) {
+                if (0 == strcmp(root, h->trees[i].root)) {
+                        tree = i;
+                        break;
+                }
+                if ((-1 == tree) && (0 == h->trees[i].root[0])) {
+                        tree = i;
+                }
+        }
+        if (-1 == tree) return -1;
+
+        struct FMTree *t = &h->trees[tree];
+        strcpy(t->root, root);
+        t->onWatchSetup = onWatchSetup;
+        t->onUpdate = onUpdate;
+        t->onDelete = onDelete;
+
+        const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        if (!treeScan(h, tree, root, (0 < cpus) ? cpus : 1) || (0 == t->dirs)) {
+                remove_tree(h, tree);
+                return -1;
+        }
+
+        const int dirs = t->dirs;
+        treeSetupDone(h, tree);
+        return dirs;
+}
+
+int FileMonitor_unMonitorTree(struct FMHandle *h, const char *root)
+{
+        if (!h || (0 > h->inotify_fd) || !root) return -1;
+
+        for (int i = 0; i < FM_MAX_TREES; i++) {
+                if (h->trees[i].root[0] && (0 == strcmp(root, h->trees[i].root))) {
+                        remove_tree(h, i);
+                        return 1;
+                }
+        }
+        return 0;
+}
+
+int FileMonitor_monitorGlob(struct FMHandle *h, const char *pattern,
+                            FMOnWatchSetup onWatchSetup, FMOnUpdate onUpdate,
+                            FMOnDelete onDelete)
+{
+        if (!h || (0 > h->inotify_fd) || !pattern) return -1;
+        if (FM_PATH_MAX_LENGTH <= strlen(pattern)) return -1;
+
+        int glob = -1;
+        for (int i = 0; i < FM_MAX_GLOBS; i++) {
+                if (0 == strcmp(pattern, h->globs[i].pattern)) {
+                        remove_glob(h, i);
+                        glob = i;
+                        break;
+                }
+                if ((-1 == glob) && (0 == h->globs[i].pattern[0])) {
+                        glob = i;
+                }
+        }
+        if (-1 == glob) return -1;
+
+        struct FMGlob *g = &h->globs[glob];
+        char dir[FM_PATH_MAX_LENGTH];
+        const char *name = globDir(pattern, dir);
+        if (!name || !globCompile(&g->match, name)) return -1;
+
+        strcpy(g->pattern, pattern);
+        g->onWatchSetup = onWatchSetup;
+        g->onUpdate = onUpdate;
+        g->onDelete = onDelete;
+
+        return globScan(h, glob);
+}
+
+int FileMonitor_unMonitorGlob(struct FMHandle *h, const char *pattern)
+{
+        if (!h || (0 > h->inotify_fd) || !pattern) return -1;
+
+        for (int i = 0; i < FM_MAX_GLOBS; i++) {
+                if (h->globs[i].pattern[0] && (0 == strcmp(pattern, h->globs[i].pattern))) {
+                        remove_glob(h, i);
+                        return 1;
+                }
+        }
+        return 0;
+}
+
+int FileMonitor_ignore(struct FMHandle *h, const char *rule)
+{
+        if (!h || !rule) return -1;
+
+        char buf[FM_PATH_MAX_LENGTH];
+        if (sizeof(buf) <= strlen(rule)) return -1;
+        strcpy(buf, rule);
+
+        // trailing blanks are dropped unless quoted
+        size_t len = strlen(buf);
+        while (len && strchr(" \t\r\n", buf[len - 1]) &&
+               !((1 < len) && ('\\' == buf[len - 2]))) {
+                buf[--len] = 0;
+        }
+        if ((0 == len) || ('#' == buf[0])) return 0;
+
+        if (FM_MAX_IGNORES <= h->ignore_count) return -1;
+        struct FMIgnore *r = &h->ignores[h->ignore_count];
+        memset(r, 0, sizeof(*r));
+
+        char *p = buf;
+        if ('!' == *p) {
+                r->negate = true;
+                ++p;
+        }
+        if ('/' == buf[len - 1]) {
+                r->dir_only = true;
+                buf[--len] = 0;
+        }
+        // anchoring is decided before the prefix is dropped
+        if (0 == strncmp(p, "**/", 3)) {
+                p += 3;
+                r->nested = (NULL != strchr(p, '/'));
+        }
+        else {
+                r->anchored = ('/' == *p) || (*p && strchr(p + 1, '/'));
+                if ('/' == *p) {++p;}
+        }
+
+        if (!globCompile(&r->match, p)) return -1;
+        // unlike the shell, * matches a leading dot
+        r->match.dotfiles = true;
+
+        ++h->ignore_count;
+        return 0;
+}
+
+const struct FMSnapshot *FileMonitor_snapshot(struct FMHandle *h, const char *path)
+{
+        if (!h || !path) return NULL;
+
+        const struct FM *fm = findPath(h, path);
+        return (fm && fm->snapshot) ? FileMonitor_snapshotRetain(fm->snapshot) : NULL;
+}
+
+const struct FMSnapshot *FileMonitor_snapshotRetain(const struct FMSnapshot *snap)
+{
+        if (snap) {
+                __atomic_add_fetch(&((struct FMSnapshot *)snap)->refs, 1, __ATOMIC_RELAXED);
+        }
+        return snap;
+}
+
+void FileMonitor_snapshotRelease(const struct FMSnapshot *snap)
+{
+        if (!snap) return;
+
+        struct FMSnapshot *s = (struct FMSnapshot *)snap;
+        if (0 == __atomic_sub_fetch(&s->refs, 1, __ATOMIC_ACQ_REL)) {
+                if (s->len) {
+                        munmap((void *)s->data, s->len);
+                }
+                free(s);
+        }
+}
+
+int FileMonitor_tailCheckpoint(struct FMHandle *h, const char *path,
+                               struct FMTailCheckpoint *cp)
+{
+        if (!h || !path || !cp) return -1;
+
+        const struct FM *fm = findPath(h, path);
+        if (!fm || !(fm->flags & FM_TAIL)) return 0;
+
+        *cp = fm->tail;
+        return 1;
+}
+
+int FileMonitor_tailResume(struct FMHandle *h, const char *path,
+                           const struct FMTailCheckpoint *cp)
+{
+        if (!h || !path || !cp) return -1;
+
+        struct FM *fm = findPath(h, path);
+        if (!fm || !(fm->flags & FM_TAIL)) return -1;
+
+        struct stat st;
+        if ((0 == stat(path, &st)) && (cp->dev == st.st_dev) &&
+            (cp->ino == st.st_ino) && (cp->offset <= (uint64_t)st.st_size)) {
+                fm->tail = *cp;
+                return 1;
+        }
+
+        // another file, start over
+        memset(&fm->tail, 0, sizeof(fm->tail));
+        return 0;
+}
+
+int FileMonitor_poll(struct FMHandle *h)
+{
+        if (!h || (0 > h->inotify_fd)) return -1;
+
+        const uint64_t now = nowMs();
+        bool polled = false;
+        FOR (h->monitors) {
+                if (fm->path[0] && backends[fm->backend].poll) {polled = true;}
+        }
+        if (!polled) return -1;
+
+        if (0 == h->poll_interval_ms) {
+                h->poll_interval_ms = FM_POLL_MIN_MS;
+                h->poll_at_ms = now;
+        }
+        if (now < h->poll_at_ms) return h->poll_at_ms - now;
+
+        h->event.received_ns = nowNs();
+        h->event.cookie = 0;
+        h->event.name = "";
+
+        // take the slots first, callbacks may change the monitors
+        int slots[FM_MAX_MONITORS];
+        int n = 0;
+        FOR (h->monitors) {
+                if (fm->path[0] && backends[fm->backend].poll) {
+                        slots[n++] = fm - h->monitors;
+                }
+        }
+
+        bool changed = false;
+        for (int i = 0; i < n; i++) {
+                struct FM *fm = &h->monitors[slots[i]];
+                const struct Backend *backend = &backends[fm->backend];
+                if (!fm->path[0] || !backend->poll || (FM_WD_LAZY == fm->wd)) continue;
+
+                if (-1 == fm->wd) {
+                        changed |= attach(h, fm);
+                        continue;
+                }
+                changed |= backend->poll(h, fm);
+        }
+
+        // back off while nothing changes
+        if (changed) {
+                h->poll_interval_ms = FM_POLL_MIN_MS;
+        }
+        else if (h->poll_interval_ms < FM_POLL_MAX_MS) {
+                h->poll_interval_ms *= 2;
+                if (h->poll_interval_ms > FM_POLL_MAX_MS) {
+                        h->poll_interval_ms = FM_POLL_MAX_MS;
+                }
+        }
+        h->poll_at_ms = now + h->poll_interval_ms;
+        return h->poll_interval_ms;
+}
+
+int FileMonitor_setWatchBudget(struct FMHandle *h, int watches)
+{
+        if (!h || (0 > h->inotify_fd) || (0 > watches)) return -1;
+
+        h->watch_budget = watches ? watches : kernelWatchLimit();
+        return h->watch_budget;
+}
+
+int FileMonitor_watchesUsed(const struct FMHandle *h)
+{
+        if (!h || (0 > h->inotify_fd)) return -1;
+
+        return h->watches;
 }
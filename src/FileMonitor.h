@@ -2,8 +2,13 @@
  * Monitor one or several file paths using a monitoring file
  * descriptor.
  *
- * Only react to IN_DELETE_SELF and IN_CLOSE_WRITE from inotify(7)
- * Moving files will probably mess things up.
+ * Only react to IN_DELETE_SELF, IN_MOVE_SELF and IN_CLOSE_WRITE on
+ * the file and IN_CREATE and IN_MOVED_TO in its parent directory, see
+ * inotify(7).
+ *
+ * A file replaced with rename(), as deploy tools do, is reported as
+ * one onUpdate and the watch moves to the new file. A file moved away
+ * from the path is reported as deleted.
  *
  * When select markes the monitoring fd as readable, dispatch
  * callbacks via the FileMonitor_dispatch() function.
@@ -13,7 +18,9 @@
  *    File has been written and closed
  *
  *  - onDelete
- *    File has been deleted
+ *    File has been deleted, or moved away
+ *
+ *    Without a handler the path is kept among the monitors.
  *
  *    The handler of this event may re-add a monitor on the path to
  *    detect if the file is again created.
@@ -22,8 +29,10 @@
  *    Watch is setup successfully.
  *
  *    This is also called when a watch is setup for a non-existing
- *    file which existance is detected with the
- *    reMonitorNonExistingPaths() function.
+ *    file which existance is detected. The parent directory of a
+ *    non-existing path is watched so creation is detected on
+ *    dispatch. If the parent directory does not exist either, the
+ *    reMonitorNonExistingPaths() function is needed.
  *
  *    Read the initial file content on this event.
  *
@@ -34,6 +43,8 @@
 #define __FILE_MONITOR_H__
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
 
 #ifndef FM_PATH_MAX_LENGTH
 #define FM_PATH_MAX_LENGTH 256
@@ -43,19 +54,397 @@
 #define FM_MAX_MONITORS 10
 #endif
 
+#ifndef FM_MAX_TREES
+#define FM_MAX_TREES 2
+#endif
+
+// directories watched for trees, shared by all trees
+#ifndef FM_MAX_TREE_DIRS
+#define FM_MAX_TREE_DIRS 64
+#endif
+
+// threads walking a tree when it is first monitored
+#ifndef FM_TREE_THREADS
+#define FM_TREE_THREADS 4
+#endif
+
+#ifndef FM_MAX_GLOBS
+#define FM_MAX_GLOBS 4
+#endif
+
+#ifndef FM_MAX_IGNORES
+#define FM_MAX_IGNORES 8
+#endif
+
+#ifndef FM_MAX_DIRS
+#define FM_MAX_DIRS (FM_MAX_MONITORS + FM_MAX_TREE_DIRS)
+#endif
+
+// index of the wds of a handle, a power of two of at least twice the
+// monitors and directories
+#ifndef FM_HANDLE_WDS
+#define FM_HANDLE_WDS 256
+#endif
+#if (FM_HANDLE_WDS & (FM_HANDLE_WDS - 1)) || \
+        (FM_HANDLE_WDS < 2 * (FM_MAX_MONITORS + FM_MAX_DIRS))
+#error "FM_HANDLE_WDS is a power of two of at least 2 * (FM_MAX_MONITORS + FM_MAX_DIRS)"
+#endif
+
+// hash buckets of expected names per watched directory, power of two
+#ifndef FM_DIR_BUCKETS
+#define FM_DIR_BUCKETS 16
+#endif
+
+// symlinks tracked per FM_FOLLOW_LINKS monitor
+#ifndef FM_MAX_LINKS
+#define FM_MAX_LINKS 4
+#endif
+
+// number of FM_FOLLOW_LINKS monitors
+#ifndef FM_MAX_LINK_MONITORS
+#define FM_MAX_LINK_MONITORS 4
+#endif
+
+// backoff of FileMonitor_reMonitorScheduled()
+#ifndef FM_RETRY_MIN_MS
+#define FM_RETRY_MIN_MS 250
+#endif
+
+#ifndef FM_RETRY_MAX_MS
+#define FM_RETRY_MAX_MS 60000
+#endif
+
+// files from this size are hashed on several threads, FM_HASH_CONTENT
+#ifndef FM_HASH_PARALLEL_MIN
+#define FM_HASH_PARALLEL_MIN (4 << 20)
+#endif
+
+#ifndef FM_HASH_THREADS
+#define FM_HASH_THREADS 4
+#endif
+
+// largest range passed to one callback, FM_TAIL, buffered in the handle
+// from the first FM_TAIL monitor on
+#ifndef FM_TAIL_WINDOW
+#define FM_TAIL_WINDOW (64 << 10)
+#endif
+
+// mtime this close to the time of a cached stat is not trusted
+#ifndef FM_STAT_RACY_NS
+#define FM_STAT_RACY_NS 20000000
+#endif
+
+// handles sharing one inotify instance, at most 64
+#ifndef FM_MAX_GROUPS
+#define FM_MAX_GROUPS 16
+#endif
+#if FM_MAX_GROUPS > 64
+#error "FM_MAX_GROUPS is at most 64"
+#endif
+
+// watches of a shared instance, a power of two
+#ifndef FM_INSTANCE_WDS
+#define FM_INSTANCE_WDS 4096
+#endif
+
+// interval of FileMonitor_poll(), from min after a change up to max
+#ifndef FM_POLL_MIN_MS
+#define FM_POLL_MIN_MS 250
+#endif
+
+#ifndef FM_POLL_MAX_MS
+#define FM_POLL_MAX_MS 8000
+#endif
+
+// filesystems marked for FM_BACKEND_FANOTIFY per handle
+#ifndef FM_MAX_FAN_MARKS
+#define FM_MAX_FAN_MARKS 4
+#endif
+
+// hash buckets of FM_BACKEND_FANOTIFY monitors by directory and name,
+// power of two
+#ifndef FM_FAN_BUCKETS
+#define FM_FAN_BUCKETS 16
+#endif
+
+// longest file handle of a parent directory, see name_to_handle_at(2)
+#ifndef FM_FID_MAX
+#define FM_FID_MAX 64
+#endif
+
+#define FM_DIRTY_WORDS ((FM_MAX_MONITORS + 63) / 64)
+
 struct FMHandle;
+struct FMInstance;
+
+/**
+ * Read-only mapping of a file, see FM_SNAPSHOT
+ */
+struct FMSnapshot {
+        const void *data; // NULL if the file is empty
+        size_t len;
+
+        // INTERNAL BELOW
+
+        int refs;
+        uint64_t dev;
+        uint64_t ino;
+        uint64_t mtime_ns;
+};
+
+/**
+ * Cached metadata of a file, see FM_STAT_FILTER
+ */
+struct FMStat {
+        uint64_t size;
+        uint64_t ino;
+        uint64_t dev;
+        int64_t mtime_ns;
+        int64_t ctime_ns;
+        int64_t taken_ns; // CLOCK_REALTIME of the statx call
+        bool valid;
+};
 
 typedef int(*FMOnWatchSetup)(struct FMHandle* h, const char* path);
 typedef int(*FMOnUpdate)(struct FMHandle* h, const char* path);
 typedef int(*FMOnDelete)(struct FMHandle* h, const char* path);
 
+/**
+ * Event passed to FMOnEvent, valid during the callback only
+ */
+struct FMEvent {
+        int id;            // of the monitor, see FileMonitor_id()
+        const char *path;  // of the monitor
+        void *context;     // FMOptions of the monitor
+        uint32_t mask;     // inotify mask, IN_CLOSE_WRITE, IN_DELETE_SELF...
+        uint32_t cookie;   // pairs IN_MOVED_FROM with IN_MOVED_TO
+        const char *name;  // entry in a watched directory, or ""
+        uint64_t received_ns; // CLOCK_MONOTONIC when read from the kernel
+        const struct FMSnapshot *snapshot; // FM_SNAPSHOT, or NULL
+
+        // FM_TAIL, len bytes appended at offset, valid during the callback
+        uint64_t offset;
+        const void *data;
+        size_t len;
+
+        // FM_STAT_FILTER, metadata before and after the update
+        const struct FMStat *stat_old;
+        const struct FMStat *stat_new;
+};
+
+/**
+ * Position of a FM_TAIL monitor, to resume from after a restart
+ */
+struct FMTailCheckpoint {
+        uint64_t dev;
+        uint64_t ino;
+        uint64_t offset; // bytes delivered
+};
+
+typedef int(*FMOnEvent)(struct FMHandle* h, const struct FMEvent* event);
+
+
+/**
+ * Monitor flags, see FileMonitor_monitorWith()
+ */
+enum FMFlags {
+        // track the symlinks leading to the file, see below
+        FM_FOLLOW_LINKS = 1 << 0,
+
+        // use the watch of the parent directory only, see below
+        FM_DIR_SCOPED = 1 << 1,
+
+        // skip updates that leave the content unchanged, see below
+        FM_HASH_CONTENT = 1 << 2,
+
+        // map the content for the callbacks, see below
+        FM_SNAPSHOT = 1 << 3,
+
+        // deliver appended bytes only, see below
+        FM_TAIL = 1 << 4,
+
+        // drop updates that changed no metadata, see below
+        FM_STAT_FILTER = 1 << 5,
+};
+
+// wd of an existing FM_DIR_SCOPED monitor, which has no watch of its own
+#define FM_WD_SCOPED -2
+
+// wd of an existing FM_BACKEND_POLL monitor
+#define FM_WD_POLLED -3
+
+// wd of an existing FM_BACKEND_FANOTIFY monitor
+#define FM_WD_FANOTIFY -4
+
+// wd of a monitor added in lazy mode, without watch yet
+#define FM_WD_LAZY -5
+
+/**
+ * How a monitor learns about changes, see FileMonitor_monitorWith()
+ */
+enum FMBackendKind {
+        FM_BACKEND_INOTIFY = 0,
+        FM_BACKEND_POLL,
+        FM_BACKEND_FANOTIFY,
+        FM_BACKENDS
+};
+
+/**
+ * Options of FileMonitor_monitorWith()
+ */
+struct FMOptions {
+        unsigned flags;
+        uint32_t mask; // inotify events in addition to the default ones
+        FMOnEvent onEvent; // called instead of onUpdate and onDelete
+        void *context;     // passed in FMEvent
+        enum FMBackendKind backend;
+};
+
+/**
+ * Directory as named in fanotify events, filesystem id and file handle
+ */
+struct FMFid {
+        uint64_t fsid;
+        int type;
+        unsigned bytes; // 0 if unknown
+        unsigned char handle[FM_FID_MAX];
+};
+
+/**
+ * Filesystem marked for fanotify, with the events asked for
+ */
+struct FMFanMark {
+        uint64_t fsid;
+        uint32_t mask; // 0 if unused
+};
 
 struct FM {
         int wd;
+        unsigned flags;
+        uint32_t mask; // events requested in addition to the default ones
+        int chain;    // symlink chain of FM_FOLLOW_LINKS, or -1
+        int glob;     // pattern that added the monitor, or -1
+        int dir;      // parent directory watch, or -1
+        int dir_next; // next monitor slot in the same directory bucket
+        uint32_t name_hash;
+        uint64_t content_hash; // FM_HASH_CONTENT, valid if hashed
+        bool hashed;
+        struct FMSnapshot *snapshot; // FM_SNAPSHOT, or NULL
+        struct FMTailCheckpoint tail; // FM_TAIL
+        struct FMStat stat;           // FM_STAT_FILTER
+        uint32_t stat_mask;           // events batched in this dispatch
+        int heap_pos; // position in the retry heap, or -1
+        uint32_t retry_delay_ms;
+        uint64_t retry_at_ms;
+        bool pending; // in the list of monitors without a watch
+        int pending_prev;
+        int pending_next;
+        int lazy_prev; // in the list of monitors added in lazy mode
+        int lazy_next;
         char path[FM_PATH_MAX_LENGTH];
         FMOnWatchSetup onWatchSetup;
         FMOnUpdate onUpdate;
         FMOnDelete onDelete;
+        FMOnEvent onEvent;
+        void *context;
+        bool subscriber; // see FileMonitor_subscribe()
+        enum FMBackendKind backend;
+        struct FMFid parent; // FM_BACKEND_FANOTIFY, directory of the path
+        int fan_bucket;      // bucket of parent and name, or -1
+        int fan_next;        // next monitor slot in the same bucket
+        bool demoted;        // polled for lack of watches
+        uint64_t changed_ms; // last update, demotion goes by it
+};
+
+/**
+ * Directory watched on behalf of one or several monitors, shared by
+ * reference count
+ */
+struct FMDir {
+        int wd;
+        int refs;     // monitors of paths in the directory, tree and globs
+        int tree;     // tree the directory is part of, or -1
+        bool fresh;   // onWatchSetup of the tree not yet called
+        uint32_t mask;
+        uint32_t hash;
+        int free_next; // next unused directory, while unused
+        char path[FM_PATH_MAX_LENGTH];
+
+        // first monitor slot per name hash, -1 if empty
+        int buckets[FM_DIR_BUCKETS];
+};
+
+/**
+ * Entry of the wd index of a handle, open addressing
+ */
+struct FMWdUse {
+        int wd;    // 0 if free
+        int users; // monitors watching wd
+        int dir;   // directory slot, or -1
+};
+
+/**
+ * A symlink passed when resolving the path of a monitor
+ */
+struct FMLink {
+        char path[FM_PATH_MAX_LENGTH];
+        int dir;      // directory watch of the link, or -1
+        uint32_t name_hash;
+};
+
+struct FMLinkChain {
+        int fm;       // monitor slot, -1 if unused
+        int count;
+        struct FMLink links[FM_MAX_LINKS];
+};
+
+/**
+ * Recursively monitored directory, see FileMonitor_monitorTree()
+ */
+struct FMTree {
+        char root[FM_PATH_MAX_LENGTH]; // empty if unused
+        FMOnWatchSetup onWatchSetup;
+        FMOnUpdate onUpdate;
+        FMOnDelete onDelete;
+        int dirs;     // directories watched
+        int skipped;  // directories not watched, table full or path too long
+        int ignored;  // directories not watched by ignore rules
+};
+
+
+/**
+ * Compiled glob, a bit-parallel matcher: bit i of classes[c] is set if
+ * token i accepts the byte c, and bit i of stars if token i repeats. A
+ * name is matched in one pass.
+ */
+struct FMMatcher {
+        uint64_t classes[256];
+        uint64_t stars;
+        uint64_t accept;
+        bool dotfiles; // pattern starts with a literal .
+};
+
+/**
+ * Pattern monitor, see FileMonitor_monitorGlob()
+ */
+struct FMGlob {
+        char pattern[FM_PATH_MAX_LENGTH]; // empty if unused
+        int dir;      // directory watch, or -1
+        struct FMMatcher match; // name part of pattern
+        FMOnWatchSetup onWatchSetup;
+        FMOnUpdate onUpdate;
+        FMOnDelete onDelete;
+};
+
+/**
+ * Exclusion rule for trees, see FileMonitor_ignore()
+ */
+struct FMIgnore {
+        struct FMMatcher match;
+        bool negate;   // rule started with !
+        bool dir_only; // rule ended with /
+        bool anchored; // matched against the path below the root
+        bool nested;   // several names after **/, matched at any depth
 };
 
 enum FMStatus {
@@ -71,11 +460,97 @@ enum FMStatus {
  */
 struct FMHandle {
         int inotify_fd;
+        int fanotify_fd; // FM_BACKEND_FANOTIFY, -1 while not used
 
         // INTERNAL BELOW
 
+        struct FMInstance *instance; // shared instance, or NULL
+        int group;                   // index among its handles
+
         struct FM monitors[FM_MAX_MONITORS];
         int count;
+
+        // event being dispatched, without id and path
+        struct FMEvent event;
+
+        // FM_STAT_FILTER monitors with updates in this dispatch
+        int stat_batch[FM_MAX_MONITORS];
+        int stat_batch_count;
+
+        // change generation per monitor slot, kept outside struct FM
+        // so that clearing a slot never races with lock-free readers
+        uint64_t generations[FM_MAX_MONITORS];
+
+        // dirty mode, one bit per monitor slot
+        bool dirty_mode;
+
+        // see FileMonitor_setLazyMode()
+        bool lazy_mode;
+        int lazy_head; // first monitor without watch yet, or -1
+        int lazy_tail;
+        int lazy_count;
+        uint64_t dirty[FM_DIRTY_WORDS];
+
+        struct FMDir dirs[FM_MAX_DIRS];
+        int dir_free; // first unused directory, or -1
+
+        // users of each watched wd
+        struct FMWdUse wd_uses[FM_HANDLE_WDS];
+        int watches; // entries of wd_uses, the kernel watches used
+
+        // monitors without a watch
+        int pending_head;
+        int pending_count;
+
+        // missing paths without a directory watch, see
+        // FileMonitor_reMonitorScheduled()
+        int retry_heap[FM_MAX_MONITORS];
+        int retry_count;
+        uint32_t retry_seed;
+
+        struct FMLinkChain chains[FM_MAX_LINK_MONITORS];
+
+        struct FMTree trees[FM_MAX_TREES];
+
+        struct FMGlob globs[FM_MAX_GLOBS];
+
+        struct FMIgnore ignores[FM_MAX_IGNORES];
+        int ignore_count;
+
+        // FM_BACKEND_POLL
+        uint32_t poll_interval_ms;
+        uint64_t poll_at_ms;
+
+        // FM_BACKEND_FANOTIFY
+        struct FMFanMark fan_marks[FM_MAX_FAN_MARKS];
+        // first monitor slot per directory and name hash, -1 if empty
+        int fan_buckets[FM_FAN_BUCKETS];
+
+        // FM_TAIL, FM_TAIL_WINDOW bytes passed to onEvent, NULL until
+        // the first FM_TAIL monitor
+        uint8_t *tail_buf;
+
+        // see FileMonitor_setWatchBudget()
+        int watch_budget;
+};
+
+struct FMWdEntry {
+        int wd;            // 0 if free
+        uint64_t handles;  // bit per handle using wd
+};
+
+/**
+ * inotify instance shared by several handles, see
+ * FileMonitor_initShared()
+ */
+struct FMInstance {
+        int inotify_fd;
+
+        // INTERNAL BELOW
+
+        struct FMHandle *handles[FM_MAX_GROUPS];
+        struct FMWdEntry wds[FM_INSTANCE_WDS];
+        int wd_count;
 };
 
 /**
@@ -88,6 +563,58 @@ struct FMHandle {
  */
 int FileMonitor_init(struct FMHandle *h);
 
+/**
+ * Remove all monitors and close the instances of h, a handle on a
+ * shared instance leaves it as with FileMonitor_leaveShared(). The
+ * handle is left uninitialized.
+ */
+void FileMonitor_close(struct FMHandle *h);
+
+/**
+ * Initialize an inotify instance to be shared by handles
+ *
+ * Each FileMonitor_init() takes an inotify instance, of which a user
+ * has max_user_instances, 128 by default. Handles initialized with
+ * FileMonitor_initShared() are views over one instance instead. An
+ * index from wd to handles routes each event to the handles watching
+ * it, and one read drains the events of all of them.
+ *
+ * Select on inst->inotify_fd and call FileMonitor_instanceDispatch(),
+ * or FileMonitor_dispatch() on any of the handles. Handles of an
+ * instance are used from one thread.
+ *
+ * return inotify_fd
+ */
+int FileMonitor_instanceInit(struct FMInstance *inst);
+
+/**
+ * Close the instance, its handles are left uninitialized
+ */
+void FileMonitor_instanceClose(struct FMInstance *inst);
+
+/**
+ * Initialize a handle on a shared instance
+ *
+ * A file or directory watched by several handles has one watch with
+ * the union of their masks, removed when the last handle lets go of
+ * it.
+ *
+ * return -1 if inst is not initialized or has FM_MAX_GROUPS handles
+ * return inotify_fd of the instance
+ */
+int FileMonitor_initShared(struct FMHandle *h, struct FMInstance *inst);
+
+/**
+ * Remove a handle from its shared instance, together with the watches
+ * no other handle uses. The handle is left uninitialized.
+ */
+void FileMonitor_leaveShared(struct FMHandle *h);
+
+/**
+ * Read and route the events of all handles of the instance
+ */
+void FileMonitor_instanceDispatch(struct FMInstance *inst);
+
 /**
  * Monitor path
  *
@@ -107,6 +634,327 @@ int FileMonitor_monitor(struct FMHandle *handle, const char *path,
                         FMOnWatchSetup onWatchSetup,FMOnUpdate onUpdate,
                         FMOnDelete onDelete);
 
+/**
+ * Monitor path with options
+ *
+ * As FileMonitor_monitor(), opt may be null.
+ *
+ * FM_FOLLOW_LINKS
+ *   The path is resolved once when watched. With this flag the
+ *   symlinks passed on the way, and their directories, are watched
+ *   too. When one of them is replaced the path is resolved again and
+ *   a new target is reported with one onUpdate. Meant for mounted
+ *   Kubernetes ConfigMaps and secrets, which update by swapping a
+ *   ..data symlink.
+ *
+ *   At most FM_MAX_LINK_MONITORS monitors, and the first
+ *   FM_MAX_LINKS links of each, are tracked.
+ *
+ * FM_DIR_SCOPED
+ *   No watch is added for the file. Close-write, delete and rename
+ *   events are taken from the watch of the parent directory, routed
+ *   by name, and the callbacks are called as before. Monitoring many
+ *   files in the same directory this way takes one kernel watch
+ *   instead of one per file. Hard links to the file in other
+ *   directories are not seen.
+ *
+ *   The wd of an existing path is FM_WD_SCOPED.
+ *
+ * FM_HASH_CONTENT
+ *   The content is hashed (xxHash64, read with pread()) when the
+ *   watch is set up and on each update. onUpdate is not called when the
+ *   file was rewritten with the same content. Files of
+ *   FM_HASH_PARALLEL_MIN bytes and more are hashed in chunks on up to
+ *   FM_HASH_THREADS threads. Unreadable files are always reported.
+ *
+ * FM_SNAPSHOT
+ *   The file is mapped read-only when the watch is set up and on each
+ *   update, before the callbacks are called. FileMonitor_snapshot()
+ *   returns the current mapping, onEvent gets it in the event. Monitors
+ *   of the same unchanged file share one mapping. A snapshot stays
+ *   valid for as long as a reference is held, also after the monitor
+ *   moved on to newer content or was removed.
+ *
+ *   The mapping shows the file as it is on disk. It is immutable for
+ *   writers that replace the file with rename(), as ConfigMaps and
+ *   most editors do. A file rewritten in place changes under the
+ *   mapping, reading a mapping beyond the end of a truncated file
+ *   raises SIGBUS.
+ *
+ * FM_TAIL
+ *   For logs and journals. Updates, including IN_MODIFY, deliver the
+ *   bytes appended since the last one to onEvent, read into a buffer
+ *   of the handle valid for the duration of the callback, in pieces of
+ *   at most FM_TAIL_WINDOW bytes, or call onUpdate for each without
+ *   onEvent. The file may be truncated meanwhile, a short read ends
+ *   the delivery until the next update.
+ *   Updates that add nothing are not reported. Tailing starts at the
+ *   end of an existing file and at the start of a created one. A
+ *   truncated file is read from the start again, and so is the new
+ *   file after a rotation, which is seen as delete followed by
+ *   creation. See FileMonitor_tailCheckpoint().
+ *
+ * FM_STAT_FILTER
+ *   Size, inode, mtime and ctime are cached from statx(). Updates are
+ *   collected during a dispatch, each monitor is stat'ed once after the
+ *   events read, and updates that changed none of them are dropped,
+ *   e.g. a file opened for writing and closed untouched. onEvent gets
+ *   the metadata before and after. An mtime within FM_STAT_RACY_NS of
+ *   the previous statx is never trusted to be unchanged, the file
+ *   system timestamp may not have moved. The cache is a few words per
+ *   monitor, the cost per dispatch follows the events, not the
+ *   monitors.
+ *
+ * mask
+ *   Events reported in addition to close-write, delete and rename, for
+ *   example IN_MODIFY for files written in a stream or IN_ATTRIB for
+ *   permission changes. onUpdate is called for each of them. Monitors
+ *   of the same file share the kernel watch, the watch gets the union
+ *   of their masks and each monitor is only called for its own events.
+ *   The default of 0 keeps the event volume down.
+ *
+ * backend
+ *   FM_BACKEND_INOTIFY, the default, uses kernel watches. They do not
+ *   see changes made by other hosts on NFS, CIFS and some FUSE file
+ *   systems, FM_BACKEND_POLL does: the file is stat'ed by
+ *   FileMonitor_poll() and changes of size, inode, mtime or ctime are
+ *   reported as updates, a vanished file as deleted. onEvent gets the
+ *   metadata before and after. FM_DIR_SCOPED only applies to inotify,
+ *   the mask is ignored when polling.
+ *
+ *   FM_BACKEND_FANOTIFY marks the whole filesystem of the path once
+ *   instead of one watch per file, events are matched to monitors by
+ *   the handle of the parent directory and the name. Select on
+ *   fanotify_fd of h as well, FileMonitor_dispatch() reads both. The
+ *   marks need CAP_SYS_ADMIN, without it the monitor uses inotify.
+ *   Only the name is monitored: writes through other hard links of the
+ *   file are not reported.
+ *
+ * onEvent
+ *   Called with an FMEvent instead of onUpdate and onDelete, with the
+ *   same return values. The event tells what happened, a handler has
+ *   no need to stat() the file, and when it was read, for measuring
+ *   the delivery latency.
+ */
+int FileMonitor_monitorWith(struct FMHandle *h, const char *path,
+                            const struct FMOptions *opt,
+                            FMOnWatchSetup onWatchSetup, FMOnUpdate onUpdate,
+                            FMOnDelete onDelete);
+
+/**
+ * Add a subscriber to path, next to any other monitor or subscriber of
+ * path, with its own options and callbacks
+ *
+ * Monitors of the same file, through the same or another path, share
+ * one kernel watch and all get its events. The watch is removed with
+ * the last of them. Tell subscribers apart with the context of onEvent.
+ *
+ * Subscribers are only known by id: FileMonitor_monitor() of the same
+ * path adds or updates a monitor of its own, and functions looking up
+ * a monitor by path do not find subscribers.
+ *
+ * return -1 on failure, as for FileMonitor_monitorWith()
+ * return id of the subscriber, also when path does not exist yet
+ */
+int FileMonitor_subscribe(struct FMHandle *h, const char *path,
+                          const struct FMOptions *opt,
+                          FMOnWatchSetup onWatchSetup, FMOnUpdate onUpdate,
+                          FMOnDelete onDelete);
+
+/**
+ * Remove the subscriber id
+ *
+ * return -1 on failure, 0 if id is not a subscriber, 1 if removed
+ */
+int FileMonitor_unsubscribe(struct FMHandle *h, int id);
+
+/**
+ * Monitor root and every directory below it
+ *
+ * New directories are watched as they are created or moved into the
+ * tree. The callbacks receive the full path below root:
+ *  - onWatchSetup for each directory once it is watched. Files
+ *    created in a new directory before it was watched are not
+ *    reported otherwise.
+ *  - onUpdate when a file is written and closed, or moved in
+ *  - onDelete when a file or directory is deleted, or moved out
+ *
+ * FM_UNMONITOR from a callback removes the whole tree.
+ *
+ * The initial walk reads directories with getdents64 on up to
+ * FM_TREE_THREADS threads. Directories are taken from a table shared
+ * with the parent watches of monitors, size it with FM_MAX_DIRS.
+ * Symlinks are not followed and a directory belongs to at most one
+ * tree.
+ *
+ * return -1 on failure
+ *  - handle is not initialized, or root is null or too long
+ *  - no more trees, max is FM_MAX_TREES
+ *
+ * return 0 if root is not a directory
+ *
+ * return number of directories watched, see FMTree for the number of
+ * directories that did not fit
+ */
+int FileMonitor_monitorTree(struct FMHandle *h, const char *root,
+                            FMOnWatchSetup onWatchSetup, FMOnUpdate onUpdate,
+                            FMOnDelete onDelete);
+
+/**
+ * Add a gitignore-style rule excluding paths from all trees
+ *
+ * Excluded directories are not watched, together with everything below
+ * them, and events for excluded paths never reach a callback. Rules
+ * apply to the directories found after they are added, add them before
+ * FileMonitor_monitorTree(). Supported syntax:
+ *  - blank lines and lines starting with # are skipped
+ *  - a rule without a slash matches a name at any depth
+ *  - a rule with a slash, or starting with /, matches the path below
+ *    the root of the tree
+ *  - a rule after a leading match-any-directory prefix (two stars and
+ *    a slash) matches at any depth, slashes or not
+ *  - a trailing / matches directories only
+ *  - ! re-includes what an earlier rule excluded, the last matching
+ *    rule decides, but nothing below an excluded directory is seen
+ *  - wildcards as in FileMonitor_monitorGlob(), they do not match /,
+ *    * matches a leading .
+ *
+ * FMTree counts the directories not watched because of the rules.
+ *
+ * return -1 if rule is invalid or there are more than FM_MAX_IGNORES
+ * return 0 otherwise
+ */
+int FileMonitor_ignore(struct FMHandle *h, const char *rule);
+
+/**
+ * Stop monitor the tree at root
+ *
+ * return -1 on failure, 0 if root is not a tree, 1 if it was removed
+ */
+int FileMonitor_unMonitorTree(struct FMHandle *h, const char *root);
+
+/**
+ * Monitor the files in a directory with a name matching pattern
+ *
+ * Only the last component of pattern may use wildcards:
+ *  - * any number of characters, ? one character
+ *  - [abc], [a-z] one of the characters, [!abc] or [^abc] none of them
+ *  - \ quotes the next character
+ * A leading . in a name is only matched by a literal . as in the shell.
+ *
+ * Matching files are monitored like with FileMonitor_monitor() and
+ * count against FM_MAX_MONITORS. Files created or moved into the
+ * directory are added, onWatchSetup is called for them. Files deleted
+ * or moved away are removed after onDelete. FM_UNMONITOR from a
+ * callback stops monitoring that file only.
+ *
+ * A missing directory is retried by reMonitorNonExistingPaths().
+ *
+ * return -1 on failure
+ *  - handle is not initialized, or pattern is null or too long
+ *  - the name part is empty or longer than 63 tokens
+ *  - no more patterns, max is FM_MAX_GLOBS
+ *
+ * return number of files monitored
+ */
+int FileMonitor_monitorGlob(struct FMHandle *h, const char *pattern,
+                            FMOnWatchSetup onWatchSetup, FMOnUpdate onUpdate,
+                            FMOnDelete onDelete);
+
+/**
+ * Stop monitor pattern and the files it added
+ *
+ * return -1 on failure, 0 if pattern is not monitored, 1 if removed
+ */
+int FileMonitor_unMonitorGlob(struct FMHandle *h, const char *pattern);
+
+/**
+ * Current content of path monitored with FM_SNAPSHOT, with a reference
+ * to give back with FileMonitor_snapshotRelease()
+ *
+ * return NULL if path is not monitored, does not exist or could not be
+ * mapped
+ */
+const struct FMSnapshot *FileMonitor_snapshot(struct FMHandle *h, const char *path);
+
+/**
+ * Take another reference on snap, for keeping the snapshot of an event
+ * beyond the callback
+ */
+const struct FMSnapshot *FileMonitor_snapshotRetain(const struct FMSnapshot *snap);
+
+/**
+ * Drop a reference on snap, the last one unmaps the file. May be
+ * called from any thread.
+ */
+void FileMonitor_snapshotRelease(const struct FMSnapshot *snap);
+
+/**
+ * Current position of the FM_TAIL monitor of path
+ *
+ * return -1 on failure, 0 if path is not tailed, 1 with cp filled in
+ */
+int FileMonitor_tailCheckpoint(struct FMHandle *h, const char *path,
+                               struct FMTailCheckpoint *cp);
+
+/**
+ * Continue the FM_TAIL monitor of path from a checkpoint, taken by an
+ * earlier run. Bytes after the checkpoint are delivered with the next
+ * update.
+ *
+ * return -1 on failure or if path is not tailed
+ * return 0 if the file is no longer the one of cp, it is read from
+ *   the start
+ * return 1 if resumed from cp
+ */
+int FileMonitor_tailResume(struct FMHandle *h, const char *path,
+                           const struct FMTailCheckpoint *cp);
+
+/**
+ * Stat all FM_BACKEND_POLL monitors of h if due, call the callbacks of
+ * the changed ones
+ *
+ * The interval starts at FM_POLL_MIN_MS and doubles up to
+ * FM_POLL_MAX_MS while nothing changes. Call it again after the
+ * returned number of ms, e.g. as select timeout. Missing paths are
+ * retried on each poll.
+ *
+ * return ms until the next poll, -1 if there are no polled monitors
+ */
+int FileMonitor_poll(struct FMHandle *h);
+
+/**
+ * Limit the kernel watches of h, 0 for max_user_watches of the kernel,
+ * the default
+ *
+ * Only watches new to h count, a path whose file or directory h
+ * already watches does not demote anything. The default is not shared
+ * out: every handle, and every handle of a shared instance, may use up
+ * to max_user_watches, which all inotify instances of the user draw
+ * from. ENOSPC from the kernel is then what demotes monitors; set a
+ * budget per handle to stay within the limit.
+ *
+ * When a monitor needs a watch beyond the budget, or the kernel runs
+ * out of watches (ENOSPC), the least recently changed monitors are
+ * demoted to FM_BACKEND_POLL, with their file and directory watches,
+ * until the watch can be added. Without any to demote the new monitor
+ * is polled itself. A demoted monitor is promoted back to inotify by
+ * FileMonitor_poll() when it changes, demoting a quieter one if need
+ * be. Call FileMonitor_poll() when using a budget. Directory watches,
+ * of monitors, trees and globs, count against the budget the same way.
+ *
+ * Monitors of trees, globs, symlink chains and subscribers are not
+ * demoted.
+ *
+ * return the budget, -1 on error
+ */
+int FileMonitor_setWatchBudget(struct FMHandle *h, int watches);
+
+/**
+ * return the number of kernel watches used by h, -1 on error
+ */
+int FileMonitor_watchesUsed(const struct FMHandle *h);
+
 /**
  * Stop monitor path
  *
@@ -145,12 +993,29 @@ int FileMonitor_nonExistingPaths(const struct FMHandle *h);
 /**
  * Check if paths that previously did not exist now exists and update
  * the monitor.
+ *
+ * Only needed for paths whose parent directory did not exist either,
+ * other paths are detected on dispatch.
  */
 // TODO: bad naming
 void FileMonitor_reMonitorNonExistingPaths(struct FMHandle *h);
 
 /**
- * Return true if path is found among monitors
+ * Check the non-existing paths that are due for a retry
+ *
+ * Like reMonitorNonExistingPaths() but each path is retried with
+ * exponential backoff, from FM_RETRY_MIN_MS up to FM_RETRY_MAX_MS
+ * with jitter. Only paths whose parent directory does not exist are
+ * retried, others are detected on dispatch.
+ *
+ * return milliseconds until the next path is due, to be used as
+ * select timeout, or -1 if there is nothing to retry
+ */
+int FileMonitor_reMonitorScheduled(struct FMHandle *h);
+
+/**
+ * Return true if path is found among monitors, subscribers not
+ * included, see FileMonitor_subscribe()
  */
 bool FileMonitor_isMonitored(struct FMHandle *h, const char* path);
 
@@ -167,4 +1032,82 @@ bool FileMonitor_isMonitored(struct FMHandle *h, const char* path);
  */
 const struct FM * FileMonitor_next(const struct FMHandle *h, const struct FM *fm);
 
+/**
+ * Monitor id of path
+ *
+ * The id is the index of the monitor slot and is valid until the path
+ * is unmonitored.
+ *
+ * return -1 if path is not monitored or h/path is null
+ */
+int FileMonitor_id(struct FMHandle *h, const char *path);
+
+/**
+ * Change generation of a monitor
+ *
+ * The generation is bumped each time an update or delete is detected
+ * on the monitor, and when the monitor is removed. Compare against a
+ * previously read value to find out if the file has changed since.
+ *
+ * Lock-free, may be called from any thread while another thread
+ * dispatches.
+ *
+ * return 0 if id is out of range
+ */
+uint64_t FileMonitor_generation(const struct FMHandle *h, int id);
+
+/**
+ * Dirty mode
+ *
+ * Instead of calling onUpdate and onDelete, dispatch marks the
+ * monitor as dirty. A burst of events on the same file collapses into
+ * one bit. Deleted paths are kept among the monitors as if onDelete
+ * returned FM_MONITOR.
+ *
+ * onWatchSetup is still called.
+ */
+void FileMonitor_setDirtyMode(struct FMHandle *h, bool enable);
+
+/**
+ * Lazy mode
+ *
+ * New paths passed to FileMonitor_monitor() and
+ * FileMonitor_monitorWith() are only recorded, with a stat of the
+ * file, and return at once. FileMonitor_setupLazy() adds their watches
+ * later, e.g. in slices when the event loop is idle, and calls
+ * onWatchSetup as each one is ready.
+ *
+ * The file is stat'ed again after its watch is added. A file written
+ * or created since it was recorded is reported to onUpdate, a deleted
+ * one to onDelete. Changes after the watch are reported by the watch.
+ * A write within FM_STAT_RACY_NS of recording can not be told from no
+ * write by the stat and is reported as well.
+ */
+void FileMonitor_setLazyMode(struct FMHandle *h, bool enable);
+
+/**
+ * Setup the watches of up to max monitors added in lazy mode, in the
+ * order they were added, all of them if max is 0
+ *
+ * Not thread-safe, from another thread hold the lock used around
+ * FileMonitor_dispatch().
+ *
+ * return the number of monitors still without watch, -1 on error
+ */
+int FileMonitor_setupLazy(struct FMHandle *h, int max);
+
+/**
+ * Harvest dirty monitors
+ *
+ * Fill ids with up to max monitor ids that have been updated or
+ * deleted since the last call, and clear them. Ids that do not fit
+ * remain dirty for the next call.
+ *
+ * Lock-free, may be called from any thread while another thread
+ * dispatches.
+ *
+ * return number of ids written or -1 if h or ids is null
+ */
+int FileMonitor_takeDirty(struct FMHandle *h, int *ids, int max);
+
 #endif
@@ -0,0 +1,364 @@
+/**
+ * Sharded dispatch over several inotify instances
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <sched.h>
+#include <poll.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+
+#include <errno.h>
+
+#include "FileMonitorShards.h"
+
+static uint32_t hashPath(const char *path)
+{
+        // FNV-1a
+        uint32_t hash = 2166136261u;
+        while (*path) {
+                hash ^= (unsigned char)*path++;
+                hash *= 16777619u;
+        }
+        return hash;
+}
+
+static int shardIndex(const struct FMShards *s, const char *path)
+{
+        return hashPath(path) % s->count;
+}
+
+// shard whose callbacks run on this thread, see shardMain()
+static __thread const struct FMShards *callbackShards;
+static __thread int callbackShard = -1;
+
+// a callback may lock its own shard only: two dispatch threads each
+// locking the shard of the other would deadlock
+static bool mayLock(const struct FMShards *s, int i)
+{
+        return (callbackShards != s) || (callbackShard == i);
+}
+
+static bool mayLockAll(const struct FMShards *s)
+{
+        return callbackShards != s;
+}
+
+// the earlier of two timeouts in ms, -1 for none
+static int soonest(int a, int b)
+{
+        if (0 > a) return b;
+        if (0 > b) return a;
+        return (a < b) ? a : b;
+}
+
+static void *shardMain(void *arg)
+{
+        struct FMShardThread *t = arg;
+        struct FMShards *s = t->s;
+        struct FMHandle *h = &s->shards[t->index];
+
+        callbackShards = s;
+        callbackShard = t->index;
+
+        // the fanotify group is opened with its first monitor, poll()
+        // skips it while it is -1
+        struct pollfd fds[3] = {
+                {.fd = h->inotify_fd, .events = POLLIN},
+                {.fd = s->stop_fd, .events = POLLIN},
+                {.fd = -1, .events = POLLIN},
+        };
+
+        for (;;) {
+                // polled monitors and missing paths are due by time
+                pthread_mutex_lock(&s->locks[t->index]);
+                const int timeout = soonest(FileMonitor_poll(h),
+                                            FileMonitor_reMonitorScheduled(h));
+                fds[2].fd = h->fanotify_fd;
+                pthread_mutex_unlock(&s->locks[t->index]);
+
+                if (0 > poll(fds, 3, timeout)) {
+                        if (EINTR == errno) continue;
+                        break;
+                }
+                if (fds[1].revents) break;
+
+                if ((fds[0].revents | fds[2].revents) & POLLIN) {
+                        pthread_mutex_lock(&s->locks[t->index]);
+                        FileMonitor_dispatch(h);
+                        pthread_mutex_unlock(&s->locks[t->index]);
+                }
+        }
+        return NULL;
+}
+
+int FileMonitor_shardsInit(struct FMShards *s, int count)
+{
+        if (!s) return -1;
+
+        memset(s, 0, sizeof(*s));
+        s->stop_fd = -1;
+
+        if (0 >= count) {
+                count = sysconf(_SC_NPROCESSORS_ONLN);
+        }
+        if (0 >= count) count = 1;
+        if (count > FM_MAX_SHARDS) count = FM_MAX_SHARDS;
+
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        // callbacks may call back into the sharded API
+        pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+
+        for (int i = 0; i < count; i++) {
+                if (0 > FileMonitor_init(&s->shards[i])) {
+                        pthread_mutexattr_destroy(&attr);
+                        FileMonitor_shardsClose(s);
+                        return -1;
+                }
+                pthread_mutex_init(&s->locks[i], &attr);
+                s->count = i + 1;
+        }
+        pthread_mutexattr_destroy(&attr);
+
+        s->stop_fd = eventfd(0, EFD_NONBLOCK);
+        if (0 > s->stop_fd) {
+                FileMonitor_shardsClose(s);
+                return -1;
+        }
+
+        return s->count;
+}
+
+int FileMonitor_shardsStart(struct FMShards *s)
+{
+        if (!s || (0 >= s->count) || s->running) return -1;
+
+        const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+        for (int i = 0; i < s->count; i++) {
+                struct FMShardThread *t = &s->threads[i];
+                t->s = s;
+                t->index = i;
+
+                pthread_attr_t attr;
+                pthread_attr_init(&attr);
+                if (0 < cpus) {
+                        cpu_set_t set;
+                        CPU_ZERO(&set);
+                        CPU_SET(i % cpus, &set);
+                        pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+                }
+
+                const int err = pthread_create(&t->thread, &attr, shardMain, t);
+                pthread_attr_destroy(&attr);
+
+                if (err) {
+                        // join the ones already started
+                        s->running = true;
+                        for (int j = i; j < s->count; j++) {
+                                s->threads[j].s = NULL;
+                        }
+                        FileMonitor_shardsStop(s);
+                        return -1;
+                }
+        }
+        s->running = true;
+        return 0;
+}
+
+void FileMonitor_shardsStop(struct FMShards *s)
+{
+        if (!s || !s->running) return;
+
+        const uint64_t one = 1;
+        (void)!write(s->stop_fd, &one, sizeof(one));
+
+        for (int i = 0; i < s->count; i++) {
+                if (s->threads[i].s) {
+                        pthread_join(s->threads[i].thread, NULL);
+                }
+        }
+
+        // re-arm for a later start
+        uint64_t value;
+        (void)!read(s->stop_fd, &value, sizeof(value));
+
+        s->running = false;
+}
+
+void FileMonitor_shardsClose(struct FMShards *s)
+{
+        if (!s) return;
+
+        FileMonitor_shardsStop(s);
+
+        for (int i = 0; i < s->count; i++) {
+                FileMonitor_close(&s->shards[i]);
+                pthread_mutex_destroy(&s->locks[i]);
+        }
+        if (0 <= s->stop_fd) {
+                close(s->stop_fd);
+                s->stop_fd = -1;
+        }
+        s->count = 0;
+}
+
+struct FMHandle *FileMonitor_shardOf(struct FMShards *s, const char *path)
+{
+        if (!s || !path || (0 >= s->count)) return NULL;
+
+        return &s->shards[shardIndex(s, path)];
+}
+
+int FileMonitor_shardsMonitor(struct FMShards *s, const char *path,
+                              FMOnWatchSetup onWatchSetup, FMOnUpdate onUpdate,
+                              FMOnDelete onDelete)
+{
+        if (!s || !path || (0 >= s->count)) return -1;
+
+        const int i = shardIndex(s, path);
+        if (!mayLock(s, i)) return -1;
+
+        pthread_mutex_lock(&s->locks[i]);
+        const int rv = FileMonitor_monitor(&s->shards[i], path,
+                                           onWatchSetup, onUpdate, onDelete);
+        pthread_mutex_unlock(&s->locks[i]);
+        return rv;
+}
+
+int FileMonitor_shardsMonitorWith(struct FMShards *s, const char *path,
+                                  const struct FMOptions *opt,
+                                  FMOnWatchSetup onWatchSetup, FMOnUpdate onUpdate,
+                                  FMOnDelete onDelete)
+{
+        if (!s || !path || (0 >= s->count)) return -1;
+
+        const int i = shardIndex(s, path);
+        if (!mayLock(s, i)) return -1;
+
+        pthread_mutex_lock(&s->locks[i]);
+        const int rv = FileMonitor_monitorWith(&s->shards[i], path, opt,
+                                               onWatchSetup, onUpdate, onDelete);
+        pthread_mutex_unlock(&s->locks[i]);
+        return rv;
+}
+
+int FileMonitor_shardsUnMonitor(struct FMShards *s, const char *path)
+{
+        if (!s || !path || (0 >= s->count)) return -1;
+
+        const int i = shardIndex(s, path);
+        if (!mayLock(s, i)) return -1;
+
+        pthread_mutex_lock(&s->locks[i]);
+        const int rv = FileMonitor_unMonitor(&s->shards[i], path);
+        pthread_mutex_unlock(&s->locks[i]);
+        return rv;
+}
+
+bool FileMonitor_shardsIsMonitored(struct FMShards *s, const char *path)
+{
+        if (!s || !path || (0 >= s->count)) return false;
+
+        const int i = shardIndex(s, path);
+        if (!mayLock(s, i)) return false;
+
+        pthread_mutex_lock(&s->locks[i]);
+        const bool rv = FileMonitor_isMonitored(&s->shards[i], path);
+        pthread_mutex_unlock(&s->locks[i]);
+        return rv;
+}
+
+int FileMonitor_shardsNonExistingPaths(struct FMShards *s)
+{
+        if (!s || (0 >= s->count) || !mayLockAll(s)) return -1;
+
+        int count = 0;
+        for (int i = 0; i < s->count; i++) {
+                pthread_mutex_lock(&s->locks[i]);
+                const int n = FileMonitor_nonExistingPaths(&s->shards[i]);
+                pthread_mutex_unlock(&s->locks[i]);
+
+                if (0 > n) return -1;
+                count += n;
+        }
+        return count;
+}
+
+void FileMonitor_shardsReMonitorNonExistingPaths(struct FMShards *s)
+{
+        if (!s || !mayLockAll(s)) return;
+
+        for (int i = 0; i < s->count; i++) {
+                pthread_mutex_lock(&s->locks[i]);
+                FileMonitor_reMonitorNonExistingPaths(&s->shards[i]);
+                pthread_mutex_unlock(&s->locks[i]);
+        }
+}
+
+const struct FM * FileMonitor_shardsNext(const struct FMShards *s,
+                                         const struct FM *fm)
+{
+        if (!s) return NULL;
+
+        int i = 0;
+        if (fm) {
+                // find the shard fm points into
+                while ((i < s->count) &&
+                       !((fm >= s->shards[i].monitors) &&
+                         (fm < s->shards[i].monitors + FM_MAX_MONITORS))) {
+                        ++i;
+                }
+        }
+
+        for (; i < s->count; i++) {
+                fm = FileMonitor_next(&s->shards[i], fm);
+                if (fm) return fm;
+        }
+        return NULL;
+}
+
+int FileMonitor_shardsId(struct FMShards *s, const char *path)
+{
+        if (!s || !path || (0 >= s->count)) return -1;
+
+        const int i = shardIndex(s, path);
+        if (!mayLock(s, i)) return -1;
+
+        pthread_mutex_lock(&s->locks[i]);
+        const int id = FileMonitor_id(&s->shards[i], path);
+        pthread_mutex_unlock(&s->locks[i]);
+
+        return (0 > id) ? -1 : (i * FM_MAX_MONITORS + id);
+}
+
+uint64_t FileMonitor_shardsGeneration(const struct FMShards *s, int id)
+{
+        if (!s || (0 > id) || (s->count * FM_MAX_MONITORS <= id)) return 0;
+
+        return FileMonitor_generation(&s->shards[id / FM_MAX_MONITORS],
+                                      id % FM_MAX_MONITORS);
+}
+
+int FileMonitor_shardsTakeDirty(struct FMShards *s, int *ids, int max)
+{
+        if (!s || !ids) return -1;
+
+        int n = 0;
+        for (int i = 0; (i < s->count) && (n < max); i++) {
+                const int got = FileMonitor_takeDirty(&s->shards[i], ids + n, max - n);
+                if (0 > got) return -1;
+
+                for (int j = n; j < n + got; j++) {
+                        ids[j] += i * FM_MAX_MONITORS;
+                }
+                n += got;
+        }
+        return n;
+}
@@ -0,0 +1,162 @@
+/**
+ * Spread monitors over several FMHandle shards, each with its own
+ * inotify instance drained by its own dispatch thread.
+ *
+ * A path always ends up in the same shard, picked by a hash of the
+ * path. Callbacks are called from the dispatch thread of the shard
+ * with the FMHandle of the shard, so the FileMonitor_* API can be
+ * used from within a callback as usual.
+ *
+ * The FileMonitor_shards* functions lock the shard of the path and
+ * may be called from any thread. Called from a callback they only
+ * take paths of the shard of the callback, and fail for others: two
+ * callbacks locking each other's shard would deadlock. The functions
+ * over all shards fail from a callback.
+ *
+ * The dispatch thread of a shard also runs FileMonitor_poll() and
+ * FileMonitor_reMonitorScheduled() of the shard when they are due.
+ *
+ * Monitor ids are unique over the shards: the id within the shard
+ * plus FM_MAX_MONITORS times the index of the shard.
+ */
+
+#ifndef __FILE_MONITOR_SHARDS_H__
+#define __FILE_MONITOR_SHARDS_H__
+
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "FileMonitor.h"
+
+#ifndef FM_MAX_SHARDS
+#define FM_MAX_SHARDS 8
+#endif
+
+struct FMShards;
+
+struct FMShardThread {
+        struct FMShards *s;
+        int index;
+        pthread_t thread;
+};
+
+/**
+ * Handle to the sharded API
+ */
+struct FMShards {
+        struct FMHandle shards[FM_MAX_SHARDS];
+        int count;
+
+        // INTERNAL BELOW
+
+        pthread_mutex_t locks[FM_MAX_SHARDS];
+        struct FMShardThread threads[FM_MAX_SHARDS];
+        int stop_fd;
+        bool running;
+};
+
+/**
+ * Initialize count shards
+ *
+ * count <= 0 means one shard per online cpu. count is capped at
+ * FM_MAX_SHARDS.
+ *
+ * return number of shards or -1 on failure
+ */
+int FileMonitor_shardsInit(struct FMShards *s, int count);
+
+/**
+ * Start one dispatch thread per shard, pinned to a cpu each
+ *
+ * return 0 on success, -1 on failure
+ */
+int FileMonitor_shardsStart(struct FMShards *s);
+
+/**
+ * Stop and join the dispatch threads
+ */
+void FileMonitor_shardsStop(struct FMShards *s);
+
+/**
+ * Stop the dispatch threads and close all shards as with
+ * FileMonitor_close()
+ */
+void FileMonitor_shardsClose(struct FMShards *s);
+
+/**
+ * The shard where path is, or would be, monitored
+ *
+ * return NULL if s or path is null
+ */
+struct FMHandle *FileMonitor_shardOf(struct FMShards *s, const char *path);
+
+/**
+ * As FileMonitor_monitor() on the shard of path
+ */
+int FileMonitor_shardsMonitor(struct FMShards *s, const char *path,
+                              FMOnWatchSetup onWatchSetup, FMOnUpdate onUpdate,
+                              FMOnDelete onDelete);
+
+/**
+ * As FileMonitor_monitorWith() on the shard of path
+ */
+int FileMonitor_shardsMonitorWith(struct FMShards *s, const char *path,
+                                  const struct FMOptions *opt,
+                                  FMOnWatchSetup onWatchSetup, FMOnUpdate onUpdate,
+                                  FMOnDelete onDelete);
+
+/**
+ * As FileMonitor_unMonitor() on the shard of path
+ */
+int FileMonitor_shardsUnMonitor(struct FMShards *s, const char *path);
+
+/**
+ * As FileMonitor_isMonitored() on the shard of path
+ */
+bool FileMonitor_shardsIsMonitored(struct FMShards *s, const char *path);
+
+/**
+ * Sum of FileMonitor_nonExistingPaths() over all shards
+ *
+ * return -1 if s is not setup properly, or when called from a callback
+ */
+int FileMonitor_shardsNonExistingPaths(struct FMShards *s);
+
+/**
+ * FileMonitor_reMonitorNonExistingPaths() on all shards
+ */
+void FileMonitor_shardsReMonitorNonExistingPaths(struct FMShards *s);
+
+/**
+ * Iterator over the monitors of all shards, see FileMonitor_next()
+ *
+ * Not synchronized with the dispatch threads.
+ */
+const struct FM * FileMonitor_shardsNext(const struct FMShards *s,
+                                         const struct FM *fm);
+
+/**
+ * As FileMonitor_id() on the shard of path, with the id over all shards
+ *
+ * return -1 if path is not monitored, or s/path is null
+ */
+int FileMonitor_shardsId(struct FMShards *s, const char *path);
+
+/**
+ * As FileMonitor_generation() for an id of FileMonitor_shardsId(),
+ * lock-free
+ *
+ * return 0 if id is out of range
+ */
+uint64_t FileMonitor_shardsGeneration(const struct FMShards *s, int id);
+
+/**
+ * As FileMonitor_takeDirty() over all shards, with the ids over all
+ * shards, lock-free. Shards are harvested in order, dirty ids that do
+ * not fit remain for the next call.
+ *
+ * return number of ids written or -1 if s or ids is null
+ */
+int FileMonitor_shardsTakeDirty(struct FMShards *s, int *ids, int max);
+
+#endif
@@ -34,24 +34,14 @@ int onDelete(struct FMHandle *fm, const char* path)
 }
 
 
-int doSelect(struct FMHandle fms[MAX_FILE_GROUPS], fd_set *rfds)
+// wait up to ms for events, forever if ms is -1
+int doSelect(int fd, fd_set *rfds, int ms)
 {
-        struct timeval tv = {1, 0};
-        int max_fd = 0;
+        struct timeval tv = {ms / 1000, (ms % 1000) * 1000};
         FD_ZERO(rfds);
+        FD_SET(fd, rfds);
 
-        for (int i=0; i<MAX_FILE_GROUPS; i++) {
-                const int fd = fms[i].inotify_fd;
-
-                if (0 == fd) continue;
-
-                FD_SET(fd, rfds);
-                if (fd > max_fd) {
-                        max_fd = fd;
-                }
-        }
-
-        return select(max_fd + 1, rfds, NULL, NULL, &tv);
+        return select(fd + 1, rfds, NULL, NULL, (0 > ms) ? NULL : &tv);
 }
 
 int indexFileUpdated(struct FMHandle *h, const char *path)
@@ -143,7 +133,9 @@ int indexFileDeleted(struct FMHandle *h, const char *path)
 int main(int argc, char *argv[])
 {
         fd_set rfds;
-        struct FMHandle groups[MAX_FILE_GROUPS] = {0};
+        // all groups share one inotify instance
+        static struct FMInstance instance;
+        static struct FMHandle groups[MAX_FILE_GROUPS];
 
         printf("Limits: " NL
                " Max Path Length %d" NL
@@ -158,30 +150,39 @@ int main(int argc, char *argv[])
         }
 
 
+        if (0 > FileMonitor_instanceInit(&instance)) {
+                perror("inotify");
+                exit(1);
+        }
+
         for (int i = 1, g = 0; i < argc; i++, g++) {
                 printf("Adding %s to monitors group %d" NL, argv[i], g);
 
-                FileMonitor_init(&groups[g]);
+                if (0 > FileMonitor_initShared(&groups[g], &instance)) {
+                        fprintf(stderr, "Can not add group %d" NL, g);
+                        exit(1);
+                }
 
                 FileMonitor_monitor(&groups[g], argv[i], indexFileUpdated,
                                     indexFileUpdated, indexFileDeleted);
         }
 
         for (;;) {
+                // creation is detected on dispatch, only paths with a
+                // missing parent directory are retried, when they are due
+                int timeout = -1;
+                for (int g=0; g<argc-1; g++) {
+                        const int due = FileMonitor_reMonitorScheduled(&groups[g]);
+                        if ((0 <= due) && ((0 > timeout) || (due < timeout))) {
+                                timeout = due;
+                        }
+                }
 
-                const int err = doSelect(groups, &rfds);
+                const int err = doSelect(instance.inotify_fd, &rfds, timeout);
 
                 if (err > 0) {
-                        for (int g=0; g<argc; g++) {
-                                struct FMHandle *group = &groups[g];
-
-                                if (FD_ISSET(group->inotify_fd, &rfds)) {
-                                        FileMonitor_dispatch(group);
-                                }
-                        }
-                }
-                for (int g=0; g<argc; g++) {
-                        FileMonitor_reMonitorNonExistingPaths(&groups[g]);
+                        // one read for all groups
+                        FileMonitor_instanceDispatch(&instance);
                 }
         }
 
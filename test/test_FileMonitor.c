@@ -1,9 +1,11 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <unistd.h>
 
+#include <sys/inotify.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
@@ -13,6 +15,7 @@
 #include "cmockery.h"
 
 #include "FileMonitor.h"
+#include "FileMonitorShards.h"
 
 #include "conveniences.h"
 
@@ -30,6 +33,11 @@ struct State {
 #define PATH_NOT_EXISTING_2 "data/nonExistingFile_2"
 #define PATH_NOT_EXISTING_3 "data/nonExistingFile_3"
 
+// created by the tests using them, removed in teardown
+#define TREE     "data/tree"
+#define GLOB_DIR "data/glob"
+#define LOG      "data/tail.log"
+
 static int doSelect(int fd, fd_set *rfds)
 {
         struct timeval tv = {0, 100};
@@ -64,6 +72,8 @@ void testFM_teardown(void **state)
         if (*state) {
                 test_free(*state);
         }
+
+        (void)system("rm -rf " TREE " " GLOB_DIR " " LOG " " LOG ".1");
 }
 
 /* Callbacks */
@@ -384,3 +394,1340 @@ void testFM_nonblocking(void **state)
 
         FileMonitor_dispatch(&fm);
 }
+
+void testFM_generation(void **state)
+{
+        struct State *s = *state;
+
+        struct FMHandle fm = {0};
+        FileMonitor_init(&fm);
+        FileMonitor_monitor(&fm, PATH, NULL, onUpdate, NULL);
+
+        const int id = FileMonitor_id(&fm, PATH);
+        assert_true(0 <= id);
+        assert_int_equal(-1, FileMonitor_id(&fm, PATH_NOT_EXISTING));
+
+        const uint64_t before = FileMonitor_generation(&fm, id);
+
+        system("echo apa > " PATH);
+
+        expect_string(onUpdate, path, PATH);
+        doSelect(fm.inotify_fd, &s->rfds);
+        FileMonitor_dispatch(&fm);
+
+        assert_true(before < FileMonitor_generation(&fm, id));
+        assert_int_equal(0, FileMonitor_generation(&fm, FM_MAX_MONITORS));
+}
+
+void testFM_takeDirty(void **state)
+{
+        struct State *s = *state;
+
+        struct FMHandle fm = {0};
+        FileMonitor_init(&fm);
+        FileMonitor_setDirtyMode(&fm, true);
+
+        // onUpdate must not be called in dirty mode
+        FileMonitor_monitor(&fm, PATH, NULL, onUpdate, NULL);
+        FileMonitor_monitor(&fm, PATH_2, NULL, onUpdate, NULL);
+
+        system("echo apa > " PATH);
+        system("echo bpa > " PATH);
+        system("echo cpa > " PATH_2);
+
+        doSelect(fm.inotify_fd, &s->rfds);
+        FileMonitor_dispatch(&fm);
+
+        int ids[FM_MAX_MONITORS] = {0};
+        assert_int_equal(1, FileMonitor_takeDirty(&fm, ids, 1));
+        assert_int_equal(1, FileMonitor_takeDirty(&fm, ids + 1, 1));
+        assert_int_equal(0, FileMonitor_takeDirty(&fm, ids, FM_MAX_MONITORS));
+
+        assert_true(((ids[0] == FileMonitor_id(&fm, PATH)) &&
+                     (ids[1] == FileMonitor_id(&fm, PATH_2))) ||
+                    ((ids[1] == FileMonitor_id(&fm, PATH)) &&
+                     (ids[0] == FileMonitor_id(&fm, PATH_2))));
+}
+
+static int shardUpdates = 0;
+
+static int onUpdate_shard(struct FMHandle* h, const char* path)
+{
+        __atomic_add_fetch(&shardUpdates, 1, __ATOMIC_RELAXED);
+
+        return FM_MONITOR;
+}
+
+static struct FMShards *crossShards;
+static const char *crossOther;
+static int crossRv[2];
+
+// monitors a path of its own shard and of the other from a callback
+static int onUpdate_shardCross(struct FMHandle* h, const char* path)
+{
+        crossRv[0] = FileMonitor_shardsMonitor(crossShards, path, NULL, NULL, NULL);
+        crossRv[1] = FileMonitor_shardsMonitor(crossShards, crossOther, NULL, NULL, NULL);
+        __atomic_add_fetch(&shardUpdates, 1, __ATOMIC_RELEASE);
+
+        return FM_MONITOR;
+}
+
+void testFM_shardsCallbackLock(void **state)
+{
+        struct FMShards s;
+        assert_int_equal(2, FileMonitor_shardsInit(&s, 2));
+
+        crossShards = &s;
+        crossOther = (FileMonitor_shardOf(&s, PATH_2) != FileMonitor_shardOf(&s, PATH)) ?
+                PATH_2 : PATH_3;
+        assert_true(FileMonitor_shardOf(&s, crossOther) != FileMonitor_shardOf(&s, PATH));
+
+        assert_int_equal(1, FileMonitor_shardsMonitor(&s, PATH, NULL, onUpdate_shardCross, NULL));
+
+        shardUpdates = 0;
+        assert_int_equal(0, FileMonitor_shardsStart(&s));
+        system("echo apa > " PATH);
+        for (int i = 0; (i < 100) &&
+                     (1 > __atomic_load_n(&shardUpdates, __ATOMIC_ACQUIRE)); i++) {
+                usleep(10000);
+        }
+        assert_int_equal(1, __atomic_load_n(&shardUpdates, __ATOMIC_ACQUIRE));
+        assert_int_equal(1, crossRv[0]);
+        assert_int_equal(-1, crossRv[1]);
+
+        // fine from any other thread
+        assert_int_equal(1, FileMonitor_shardsMonitor(&s, crossOther, NULL, NULL, NULL));
+
+        FileMonitor_shardsClose(&s);
+}
+
+void testFM_shards(void **state)
+{
+        struct FMShards s;
+        assert_int_equal(2, FileMonitor_shardsInit(&s, 2));
+
+        FileMonitor_shardsMonitor(&s, PATH, NULL, onUpdate_shard, NULL);
+        FileMonitor_shardsMonitor(&s, PATH_2, NULL, onUpdate_shard, NULL);
+        FileMonitor_shardsMonitor(&s, PATH_3, NULL, onUpdate_shard, NULL);
+        FileMonitor_shardsMonitor(&s, PATH_NOT_EXISTING, NULL, NULL, NULL);
+
+        assert_true(FileMonitor_shardsIsMonitored(&s, PATH_2));
+        assert_true(FileMonitor_isMonitored(FileMonitor_shardOf(&s, PATH_3),
+                                            PATH_3));
+        assert_int_equal(1, FileMonitor_shardsNonExistingPaths(&s));
+
+        int n = 0;
+        const struct FM *fm = NULL;
+        while (NULL != (fm = FileMonitor_shardsNext(&s, fm))) {++n;}
+        assert_int_equal(4, n);
+
+        shardUpdates = 0;
+        assert_int_equal(0, FileMonitor_shardsStart(&s));
+
+        system("echo apa > " PATH);
+        system("echo bpa > " PATH_2);
+        system("echo cpa > " PATH_3);
+
+        for (int i = 0; (i < 100) &&
+                     (3 > __atomic_load_n(&shardUpdates, __ATOMIC_RELAXED)); i++) {
+                usleep(10000);
+        }
+        assert_int_equal(3, __atomic_load_n(&shardUpdates, __ATOMIC_RELAXED));
+
+        assert_int_equal(1, FileMonitor_shardsUnMonitor(&s, PATH));
+        assert_false(FileMonitor_shardsIsMonitored(&s, PATH));
+
+        FileMonitor_shardsClose(&s);
+}
+
+// polled monitors and dirty ids of the shards, from the dispatch threads
+void testFM_shardsPollDirty(void **state)
+{
+        struct FMShards s;
+        assert_int_equal(2, FileMonitor_shardsInit(&s, 2));
+        for (int i = 0; i < s.count; i++) {
+                FileMonitor_setDirtyMode(&s.shards[i], true);
+        }
+
+        const struct FMOptions opt = {.backend = FM_BACKEND_POLL};
+        assert_int_equal(1, FileMonitor_shardsMonitorWith(&s, PATH, &opt, NULL, NULL, NULL));
+        assert_int_equal(1, FileMonitor_shardsMonitor(&s, PATH_2, NULL, NULL, NULL));
+
+        const int polled = FileMonitor_shardsId(&s, PATH);
+        const int watched = FileMonitor_shardsId(&s, PATH_2);
+        assert_true(0 <= polled);
+        assert_true(0 <= watched);
+        assert_true(polled != watched);
+        assert_int_equal(-1, FileMonitor_shardsId(&s, PATH_NOT_EXISTING));
+        const uint64_t generation = FileMonitor_shardsGeneration(&s, polled);
+
+        assert_int_equal(0, FileMonitor_shardsStart(&s));
+        system("echo apa >> " PATH);
+        system("echo bpa >> " PATH_2);
+
+        int ids[FM_MAX_MONITORS];
+        bool seen[2] = {false, false};
+        for (int i = 0; (i < 300) && !(seen[0] && seen[1]); i++) {
+                const int n = FileMonitor_shardsTakeDirty(&s, ids, FM_MAX_MONITORS);
+                for (int j = 0; j < n; j++) {
+                        seen[0] |= (polled == ids[j]);
+                        seen[1] |= (watched == ids[j]);
+                }
+                usleep(10000);
+        }
+        assert_true(seen[0]);
+        assert_true(seen[1]);
+        assert_true(generation < FileMonitor_shardsGeneration(&s, polled));
+
+        FileMonitor_shardsClose(&s);
+        assert_int_equal(-1, s.shards[0].inotify_fd);
+}
+
+void testFM_detectFileCreationOnDispatch(void **state)
+{
+        struct State *s = *state;
+
+        struct FMHandle fm = {0};
+        FileMonitor_init(&fm);
+        FileMonitor_monitor(&fm, PATH_NOT_EXISTING, onWatchSetup, onUpdate, NULL);
+        FileMonitor_monitor(&fm, PATH_NOT_EXISTING_2, onWatchSetup, onUpdate, NULL);
+        assert_int_equal(2, FileMonitor_nonExistingPaths(&fm));
+
+        // no reMonitorNonExistingPaths() needed
+        system("touch " PATH_NOT_EXISTING);
+
+        expect_string(onWatchSetup, path, PATH_NOT_EXISTING);
+        assert_int_not_equal(0, doSelect(fm.inotify_fd, &s->rfds));
+        FileMonitor_dispatch(&fm);
+        assert_int_equal(1, FileMonitor_nonExistingPaths(&fm));
+
+        system("echo apa > " PATH_NOT_EXISTING);
+
+        expect_string(onUpdate, path, PATH_NOT_EXISTING);
+        assert_int_not_equal(0, doSelect(fm.inotify_fd, &s->rfds));
+        FileMonitor_dispatch(&fm);
+}
+
+static int dirsInUse(const struct FMHandle *h, int *refs)
+{
+        int n = 0;
+        *refs = 0;
+        for (int i = 0; i < FM_MAX_DIRS; i++) {
+                if (h->dirs[i].refs) {
+                        ++n;
+                        *refs += h->dirs[i].refs;
+                }
+        }
+        return n;
+}
+
+void testFM_sharedParentWatch(void **state)
+{
+        struct State *s = *state;
+        int refs = 0;
+
+        struct FMHandle fm = {0};
+        FileMonitor_init(&fm);
+        FileMonitor_monitor(&fm, PATH_NOT_EXISTING, onWatchSetup, NULL, NULL);
+        FileMonitor_monitor(&fm, PATH_NOT_EXISTING_2, onWatchSetup, NULL, NULL);
+        FileMonitor_monitor(&fm, PATH_NOT_EXISTING_3, onWatchSetup, NULL, NULL);
+
+        // one watch on data/ for all three
+        assert_int_equal(1, dirsInUse(&fm, &refs));
+        assert_int_equal(3, refs);
+
+        system("touch " PATH_NOT_EXISTING_2);
+
+        expect_string(onWatchSetup, path, PATH_NOT_EXISTING_2);
+        doSelect(fm.inotify_fd, &s->rfds);
+        FileMonitor_dispatch(&fm);
+
+        // existing paths keep the directory watch to detect renames
+        assert_int_equal(1, dirsInUse(&fm, &refs));
+        assert_int_equal(3, refs);
+
+        FileMonitor_unMonitor(&fm, PATH_NOT_EXISTING);
+        FileMonitor_unMonitor(&fm, PATH_NOT_EXISTING_3);
+        assert_int_equal(1, dirsInUse(&fm, &refs));
+        assert_int_equal(1, refs);
+
+        FileMonitor_unMonitor(&fm, PATH_NOT_EXISTING_2);
+        assert_int_equal(0, dirsInUse(&fm, &refs));
+}
+
+#define DIR_NOT_EXISTING "data/nonExistingDir"
+#define PATH_IN_DIR_NOT_EXISTING DIR_NOT_EXISTING "/file"
+
+void testFM_reMonitorScheduled(void **state)
+{
+        (void)system("rm -rf " DIR_NOT_EXISTING);
+
+        struct FMHandle fm = {0};
+        FileMonitor_init(&fm);
+        assert_int_equal(-1, FileMonitor_reMonitorScheduled(&fm));
+
+        // data/ is watched, nothing to retry
+        FileMonitor_monitor(&fm, PATH_NOT_EXISTING, onWatchSetup, NULL, NULL);
+        assert_int_equal(-1, FileMonitor_reMonitorScheduled(&fm));
+
+        FileMonitor_monitor(&fm, PATH_IN_DIR_NOT_EXISTING,
+                            onWatchSetup, NULL, NULL);
+
+        int timeout = FileMonitor_reMonitorScheduled(&fm);
+        assert_true(0 <= timeout);
+        assert_true(FM_RETRY_MIN_MS >= timeout);
+
+        // still missing, backs off
+        usleep((timeout + 1) * 1000);
+        timeout = FileMonitor_reMonitorScheduled(&fm);
+        assert_true(FM_RETRY_MIN_MS / 2 <= timeout);
+
+        (void)system("mkdir -p " DIR_NOT_EXISTING);
+        (void)system("touch " PATH_IN_DIR_NOT_EXISTING);
+
+        usleep((timeout + 1) * 1000);
+        expect_string(onWatchSetup, path, PATH_IN_DIR_NOT_EXISTING);
+        assert_int_equal(-1, FileMonitor_reMonitorScheduled(&fm));
+
+        (void)system("rm -rf " DIR_NOT_EXISTING);
+}
+
+void testFM_nonExistingPathsCount(void **state)
+{
+        struct State *s = *state;
+
+        struct FMHandle fm = {0};
+        FileMonitor_init(&fm);
+        FileMonitor_monitor(&fm, PATH, NULL, NULL, onDelete_reMonitor);
+        FileMonitor_monitor(&fm, PATH_NOT_EXISTING, NULL, NULL, NULL);
+        FileMonitor_monitor(&fm, PATH_NOT_EXISTING_2, NULL, NULL, NULL);
+        assert_int_equal(2, FileMonitor_nonExistingPaths(&fm));
+
+        FileMonitor_unMonitor(&fm, PATH_NOT_EXISTING);
+        assert_int_equal(1, FileMonitor_nonExistingPaths(&fm));
+
+        // deleted and kept among monitors
+        remove(PATH);
+        expect_string(onDelete_reMonitor, path, PATH);
+        doSelect(fm.inotify_fd, &s->rfds);
+        FileMonitor_dispatch(&fm);
+        assert_int_equal(2, FileMonitor_nonExistingPaths(&fm));
+
+        system("touch " PATH " " PATH_NOT_EXISTING_2);
+        FileMonitor_reMonitorNonExistingPaths(&fm);
+        assert_int_equal(0, FileMonitor_nonExistingPaths(&fm));
+}
+
+void testFM_renameOver(void **state)
+{
+        struct State *s = *state;
+
+        struct FMHandle fm = {0};
+        FileMonitor_init(&fm);
+        FileMonitor_monitor(&fm, PATH, NULL, onUpdate, onDelete);
+
+        // deploy: write a temporary file and rename it over the path
+        system("echo apa > " PATH_NOT_EXISTING);
+        rename(PATH_NOT_EXISTING, PATH);
+
+        expect_string(onUpdate, path, PATH);
+        assert_int_not_equal(0, doSelect(fm.inotify_fd, &s->rfds));
+        FileMonitor_dispatch(&fm);
+        assert_int_equal(0, FileMonitor_nonExistingPaths(&fm));
+
+        // the watch follows the new file
+        system("echo bpa > " PATH);
+
+        expect_string(onUpdate, path, PATH);
+        assert_int_not_equal(0, doSelect(fm.inotify_fd, &s->rfds));
+        FileMonitor_dispatch(&fm);
+}
+
+void testFM_moveAway(void **state)
+{
+        struct State *s = *state;
+
+        struct FMHandle fm = {0};
+        FileMonitor_init(&fm);
+        expect_string(onWatchSetup, path, PATH);
+        FileMonitor_monitor(&fm, PATH, onWatchSetup, onUpdate, onDelete);
+
+        rename(PATH, PATH_NOT_EXISTING);
+
+        expect_string(onDelete, path, PATH);
+        assert_int_not_equal(0, doSelect(fm.inotify_fd, &s->rfds));
+        FileMonitor_dispatch(&fm);
+        assert_int_equal(1, FileMonitor_nonExistingPaths(&fm));
+
+        // writing the moved file is not an update of the path
+        system("echo apa > " PATH_NOT_EXISTING);
+        doSelect(fm.inotify_fd, &s->rfds);
+        FileMonitor_dispatch(&fm);
+
+        rename(PATH_NOT_EXISTING, PATH);
+
+        expect_string(onWatchSetup, path, PATH);
+        assert_int_not_equal(0, doSelect(fm.inotify_fd, &s->rfds));
+        FileMonitor_dispatch(&fm);
+        assert_int_equal(0, FileMonitor_nonExistingPaths(&fm));
+}
+
+#define CONFIGMAP "data/configmap"
+
+static void drain(struct FMHandle *h, struct State *s)
+{
+        while (0 < doSelect(h->inotify_fd, &s->rfds)) {
+                FileMonitor_dispatch(h);
+        }
+}
+
+void testFM_followLinks(void **state)
+{
+        struct State *s = *state;
+
+        // layout of a mounted ConfigMap
+        (void)system("rm -rf " CONFIGMAP " && mkdir -p " CONFIGMAP "/..v1");
+        (void)system("echo apa > " CONFIGMAP "/..v1/key");
+        (void)system("ln -s ..v1 " CONFIGMAP "/..data");
+        (void)system("ln -s ..data/key " CONFIGMAP "/key");
+
+        struct FMHandle fm = {0};
+        FileMonitor_init(&fm);
+
+        const struct FMOptions opt = {.flags = FM_FOLLOW_LINKS};
+        assert_int_equal(1, FileMonitor_monitorWith(&fm, CONFIGMAP "/key", &opt,
+                                                    NULL, onUpdate, onDelete));
+
+        // atomic swap of ..data, then removal of the old version
+        (void)system("mkdir " CONFIGMAP "/..v2 && echo bpa > " CONFIGMAP "/..v2/key");
+        (void)system("ln -s ..v2 " CONFIGMAP "/..data_tmp");
+        drain(&fm, s);
+
+        rename(CONFIGMAP "/..data_tmp", CONFIGMAP "/..data");
+        (void)system("rm -rf " CONFIGMAP "/..v1");
+
+        expect_string(onUpdate, path, CONFIGMAP "/key");
+        drain(&fm, s);
+
+        // the watch follows the new target
+        (void)system("echo cpa > " CONFIGMAP "/..v2/key");
+
+        expect_string(onUpdate, path, CONFIGMAP "/key");
+        drain(&fm, s);
+
+        (void)system("rm -rf " CONFIGMAP);
+}
+
+// number of kernel watches of an inotify fd
+static int kernelWatches(int fd)
+{
+        char path[64];
+        char line[512];
+        int n = 0;
+
+        snprintf(path, sizeof(path), "/proc/self/fdinfo/%d", fd);
+        FILE *f = fopen(path, "r");
+        if (!f) return -1;
+        while (fgets(line, sizeof(line), f)) {
+                if (0 == strncmp(line, "inotify wd:", 11)) {++n;}
+        }
+        fclose(f);
+        return n;
+}
+
+// events of a kernel watch of an inotify fd, 0 if there is none
+static uint32_t kernelMask(int fd, int wd)
+{
+        char path[64];
+        char line[512];
+        uint32_t mask = 0;
+
+        snprintf(path, sizeof(path), "/proc/self/fdinfo/%d", fd);
+        FILE *f = fopen(path, "r");
+        if (!f) return 0;
+        while (fgets(line, sizeof(line), f)) {
+                int w;
+                unsigned m;
+                if ((2 == sscanf(line, "inotify wd:%x ino:%*x sdev:%*x mask:%x", &w, &m)) &&
+                    (wd == w)) {
+                        mask = m;
+                }
+        }
+        fclose(f);
+        return mask;
+}
+
+void testFM_dirScoped(void **state)
+{
+        struct State *s = *state;
+
+        struct FMHandle fm = {0};
+        FileMonitor_init(&fm);
+
+        const struct FMOptions opt = {.flags = FM_DIR_SCOPED};
+        expect_string(onWatchSetup, path, PATH);
+        expect_string(onWatchSetup, path, PATH_2);
+        assert_int_equal(1, FileMonitor_monitorWith(&fm, PATH, &opt,
+                                                    onWatchSetup, onUpdate, onDelete));
+        assert_int_equal(1, FileMonitor_monitorWith(&fm, PATH_2, &opt,
+                                                    onWatchSetup, onUpdate, onDelete));
+        assert_int_equal(0, FileMonitor_monitorWith(&fm, PATH_NOT_EXISTING, &opt,
+                                                    onWatchSetup, onUpdate, onDelete));
+
+        // only data/ is watched
+        assert_int_equal(1, kernelWatches(fm.inotify_fd));
+        assert_int_equal(FM_WD_SCOPED, fm.monitors[FileMonitor_id(&fm, PATH)].wd);
+
+        system("echo apa > " PATH_2);
+        system("echo bpa > " PATH_3);
+
+        expect_string(onUpdate, path, PATH_2);
+        drain(&fm, s);
+
+        remove(PATH);
+        system("echo cpa > " PATH_NOT_EXISTING);
+
+        expect_string(onDelete, path, PATH);
+        expect_string(onWatchSetup, path, PATH_NOT_EXISTING);
+        expect_string(onUpdate, path, PATH_NOT_EXISTING);
+        drain(&fm, s);
+
+        assert_int_equal(1, FileMonitor_nonExistingPaths(&fm));
+        assert_int_equal(1, kernelWatches(fm.inotify_fd));
+}
+
+static int treeSetups = 0;
+
+static int onWatchSetup_tree(struct FMHandle* h, const char* path)
+{
+        printf(YEL "%s :: %s" RESET NL, __FUNCTION__, path);
+
+        ++treeSetups;
+        return FM_MONITOR;
+}
+
+void testFM_monitorTree(void **state)
+{
+        struct State *s = *state;
+
+        (void)system("rm -rf " TREE " && mkdir -p " TREE "/a/b " TREE "/c");
+        (void)system("touch " TREE "/a/file");
+
+        struct FMHandle fm = {0};
+        FileMonitor_init(&fm);
+
+        treeSetups = 0;
+        assert_int_equal(4, FileMonitor_monitorTree(&fm, TREE, onWatchSetup_tree,
+                                                    onUpdate, onDelete));
+        assert_int_equal(4, treeSetups);
+        assert_int_equal(4, kernelWatches(fm.inotify_fd));
+        assert_int_equal(0, FileMonitor_monitorTree(&fm, PATH_NOT_EXISTING, NULL,
+                                                    NULL, NULL));
+
+        system("echo apa > " TREE "/a/b/file");
+
+        expect_string(onUpdate, path, TREE "/a/b/file");
+        drain(&fm, s);
+
+        // a new directory is watched before the file is written
+        system("mkdir " TREE "/d");
+        drain(&fm, s);
+        assert_int_equal(5, treeSetups);
+
+        system("echo bpa > " TREE "/d/file");
+        expect_string(onUpdate, path, TREE "/d/file");
+        drain(&fm, s);
+
+        // removing a directory releases the watches below it
+        remove(TREE "/a/file");
+        expect_string(onDelete, path, TREE "/a/file");
+        drain(&fm, s);
+
+        system("rm -rf " TREE "/a");
+        expect_string(onDelete, path, TREE "/a/b/file");
+        expect_string(onDelete, path, TREE "/a/b");
+        expect_string(onDelete, path, TREE "/a");
+        drain(&fm, s);
+        assert_int_equal(3, fm.trees[0].dirs);
+        assert_int_equal(3, kernelWatches(fm.inotify_fd));
+
+        assert_int_equal(1, FileMonitor_unMonitorTree(&fm, TREE));
+        drain(&fm, s);
+        assert_int_equal(0, kernelWatches(fm.inotify_fd));
+        assert_int_equal(0, FileMonitor_unMonitorTree(&fm, TREE));
+}
+
+void testFM_monitorGlob(void **state)
+{
+        struct State *s = *state;
+
+        (void)system("rm -rf " GLOB_DIR " && mkdir -p " GLOB_DIR);
+        (void)system("touch " GLOB_DIR "/a.yaml " GLOB_DIR "/b.txt "
+                     GLOB_DIR "/.c.yaml");
+
+        struct FMHandle fm = {0};
+        FileMonitor_init(&fm);
+
+        assert_int_equal(-1, FileMonitor_monitorGlob(&fm, GLOB_DIR "/", NULL,
+                                                     NULL, NULL));
+
+        expect_string(onWatchSetup, path, GLOB_DIR "/a.yaml");
+        assert_int_equal(1, FileMonitor_monitorGlob(&fm, GLOB_DIR "/[a-c]*.y?ml",
+                                                    onWatchSetup, onUpdate, onDelete));
+
+        system("echo apa > " GLOB_DIR "/c.yaml");
+        system("echo apa > " GLOB_DIR "/d.yaml");
+        system("echo apa > " GLOB_DIR "/c.txt");
+
+        expect_string(onWatchSetup, path, GLOB_DIR "/c.yaml");
+        drain(&fm, s);
+        assert_true(FileMonitor_isMonitored(&fm, GLOB_DIR "/c.yaml"));
+        assert_false(FileMonitor_isMonitored(&fm, GLOB_DIR "/d.yaml"));
+
+        system("echo bpa > " GLOB_DIR "/c.yaml");
+        expect_string(onUpdate, path, GLOB_DIR "/c.yaml");
+        drain(&fm, s);
+
+        remove(GLOB_DIR "/a.yaml");
+        expect_string(onDelete, path, GLOB_DIR "/a.yaml");
+        drain(&fm, s);
+        assert_false(FileMonitor_isMonitored(&fm, GLOB_DIR "/a.yaml"));
+        assert_int_equal(0, FileMonitor_nonExistingPaths(&fm));
+
+        assert_int_equal(1, FileMonitor_unMonitorGlob(&fm, GLOB_DIR "/[a-c]*.y?ml"));
+        assert_false(FileMonitor_isMonitored(&fm, GLOB_DIR "/c.yaml"));
+        drain(&fm, s);
+        assert_int_equal(0, kernelWatches(fm.inotify_fd));
+}
+
+void testFM_treeIgnore(void **state)
+{
+        struct State *s = *state;
+
+        (void)system("rm -rf " TREE " && mkdir -p " TREE "/.git/objects "
+                     TREE "/build/obj " TREE "/src/build " TREE "/src/cache");
+
+        struct FMHandle fm = {0};
+        FileMonitor_init(&fm);
+
+        assert_int_equal(0, FileMonitor_ignore(&fm, "# comment"));
+        assert_int_equal(0, FileMonitor_ignore(&fm, ".git/"));
+        assert_int_equal(0, FileMonitor_ignore(&fm, "/build"));
+        assert_int_equal(0, FileMonitor_ignore(&fm, "ca*"));
+        assert_int_equal(0, FileMonitor_ignore(&fm, "*.o"));
+        assert_int_equal(0, FileMonitor_ignore(&fm, "!keep.o"));
+
+        // root, src and src/build
+        treeSetups = 0;
+        assert_int_equal(3, FileMonitor_monitorTree(&fm, TREE, onWatchSetup_tree,
+                                                    onUpdate, onDelete));
+        assert_int_equal(3, fm.trees[0].ignored);
+        assert_int_equal(3, kernelWatches(fm.inotify_fd));
+
+        system("mkdir " TREE "/src/cache/x " TREE "/src/cached");
+        system("touch " TREE "/src/a.o " TREE "/build/b " TREE "/.git/c");
+        system("echo apa > " TREE "/src/build/keep.o");
+
+        expect_string(onUpdate, path, TREE "/src/build/keep.o");
+        drain(&fm, s);
+        assert_int_equal(4, fm.trees[0].ignored);
+        assert_int_equal(3, treeSetups);
+}
+
+void testFM_treeIgnoreNested(void **state)
+{
+        (void)system("rm -rf " TREE " && mkdir -p " TREE "/a/b " TREE "/x/a/b");
+
+        struct FMHandle fm = {0};
+        FileMonitor_init(&fm);
+
+        // a/b at any depth, not only below the root
+        assert_int_equal(0, FileMonitor_ignore(&fm, "**/a/b"));
+
+        // root, a, x and x/a
+        assert_int_equal(4, FileMonitor_monitorTree(&fm, TREE, NULL, onUpdate, onDelete));
+        assert_int_equal(2, fm.trees[0].ignored);
+        assert_int_equal(4, kernelWatches(fm.inotify_fd));
+}
+
+void testFM_eventMaskSharedDir(void **state)
+{
+        struct FMHandle fm = {0};
+        FileMonitor_init(&fm);
+
+        // data is watched for the creation of the file
+        assert_int_equal(0, FileMonitor_monitor(&fm, PATH_NOT_EXISTING, NULL, onUpdate, onDelete));
+        const int wd = fm.dirs[fm.monitors[FileMonitor_id(&fm, PATH_NOT_EXISTING)].dir].wd;
+        assert_true(kernelMask(fm.inotify_fd, wd) & IN_CREATE);
+
+        // the same inode watched as a file keeps the directory events
+        assert_int_equal(1, FileMonitor_monitor(&fm, "data", NULL, onUpdate, onDelete));
+        assert_int_equal(wd, fm.monitors[FileMonitor_id(&fm, "data")].wd);
+        assert_true(kernelMask(fm.inotify_fd, wd) & IN_CREATE);
+}
+
+void testFM_eventMask(void **state)
+{
+        struct State *s = *state;
+
+        struct FMHandle fm = {0};
+        FileMonitor_init(&fm);
+
+        const struct FMOptions opt = {.mask = IN_MODIFY | IN_ATTRIB};
+        assert_int_equal(1, FileMonitor_monitorWith(&fm, PATH, &opt,
+                                                    NULL, onUpdate, onDelete));
+        assert_int_equal(1, FileMonitor_monitor(&fm, PATH_2, NULL, onUpdate, onDelete));
+
+        // only PATH asked for attribute changes
+        chmod(PATH, 0600);
+        chmod(PATH_2, 0600);
+        expect_string(onUpdate, path, PATH);
+        drain(&fm, s);
+
+        // a streaming writer is seen before it closes the file
+        FILE *f = fopen(PATH, "a");
+        fputs("apa", f);
+        fflush(f);
+        expect_string(onUpdate, path, PATH);
+        drain(&fm, s);
+
+        fclose(f);
+        expect_string(onUpdate, path, PATH);
+        drain(&fm, s);
+}
+
+static struct FMEvent lastEvent;
+static char lastEventName[FM_PATH_MAX_LENGTH];
+
+static int onEvent(struct FMHandle* h, const struct FMEvent* event)
+{
+        printf(GREEN "%s :: %s %x" RESET NL, __FUNCTION__, event->path, event->mask);
+
+        check_expected(event->path);
+
+        lastEvent = *event;
+        strcpy(lastEventName, event->name);
+        return FM_MONITOR;
+}
+
+void testFM_onEvent(void **state)
+{
+        struct State *s = *state;
+
+        struct FMHandle fm = {0};
+        FileMonitor_init(&fm);
+
+        const struct FMOptions opt = {.onEvent = onEvent};
+        assert_int_equal(1, FileMonitor_monitorWith(&fm, PATH, &opt,
+                                                    NULL, onUpdate, onDelete));
+        const struct FMOptions scoped = {.flags = FM_DIR_SCOPED, .onEvent = onEvent};
+        assert_int_equal(1, FileMonitor_monitorWith(&fm, PATH_2, &scoped,
+                                                    NULL, onUpdate, onDelete));
+
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        const uint64_t before = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+
+        system("echo apa > " PATH);
+        expect_string(onEvent, event->path, PATH);
+        drain(&fm, s);
+        assert_int_equal(FileMonitor_id(&fm, PATH), lastEvent.id);
+        assert_true(lastEvent.mask & IN_CLOSE_WRITE);
+        assert_string_equal("", lastEventName);
+        assert_true(before <= lastEvent.received_ns);
+
+        remove(PATH_2);
+        expect_string(onEvent, event->path, PATH_2);
+        drain(&fm, s);
+        assert_true(lastEvent.mask & IN_DELETE);
+        assert_string_equal("watchedFile_2.txt", lastEventName);
+}
+
+void testFM_hashContent(void **state)
+{
+        struct State *s = *state;
+
+        system("echo apa > " PATH);
+
+        struct FMHandle fm = {0};
+        FileMonitor_init(&fm);
+
+        const struct FMOptions opt = {.flags = FM_HASH_CONTENT};
+        assert_int_equal(1, FileMonitor_monitorWith(&fm, PATH, &opt,
+                                                    NULL, onUpdate, onDelete));
+
+        // same content, no update
+        system("echo apa > " PATH);
+        drain(&fm, s);
+
+        system("echo bpa > " PATH);
+        expect_string(onUpdate, path, PATH);
+        drain(&fm, s);
+
+        // hashed in parallel chunks
+        system("truncate -s 9M " PATH);
+        expect_string(onUpdate, path, PATH);
+        drain(&fm, s);
+
+        system("truncate -s 9M " PATH);
+        drain(&fm, s);
+
+        system("echo cpa >> " PATH);
+        expect_string(onUpdate, path, PATH);
+        drain(&fm, s);
+
+        system("truncate -s 0 " PATH);
+        expect_string(onUpdate, path, PATH);
+        drain(&fm, s);
+}
+
+void testFM_snapshot(void **state)
+{
+        struct State *s = *state;
+
+        system("echo apa > " PATH);
+
+        struct FMHandle fm = {0};
+        FileMonitor_init(&fm);
+
+        const struct FMOptions opt = {.flags = FM_SNAPSHOT};
+        assert_int_equal(1, FileMonitor_monitorWith(&fm, PATH, &opt,
+                                                    NULL, onUpdate, onDelete));
+        assert_int_equal(1, FileMonitor_monitorWith(&fm, "data/./watchedFile.txt", &opt,
+                                                    NULL, NULL, NULL));
+
+        const struct FMSnapshot *first = FileMonitor_snapshot(&fm, PATH);
+        assert_true(NULL != first);
+        assert_int_equal(4, first->len);
+        assert_memory_equal("apa\n", first->data, 4);
+
+        // one mapping for both monitors of the file
+        const struct FMSnapshot *other = FileMonitor_snapshot(&fm, "data/./watchedFile.txt");
+        assert_true(first == other);
+        FileMonitor_snapshotRelease(other);
+
+        system("echo bpa2 > " PATH_3 " && mv " PATH_3 " " PATH);
+        expect_string(onUpdate, path, PATH);
+        drain(&fm, s);
+
+        const struct FMSnapshot *second = FileMonitor_snapshot(&fm, PATH);
+        assert_true(NULL != second);
+        assert_memory_equal("bpa2\n", second->data, 5);
+
+        // the old content stays while referenced
+        assert_memory_equal("apa\n", first->data, 4);
+        FileMonitor_snapshotRelease(first);
+        FileMonitor_snapshotRelease(second);
+
+        FileMonitor_unMonitor(&fm, PATH);
+        assert_true(NULL == FileMonitor_snapshot(&fm, PATH));
+}
+
+static char tailed[64];
+static uint64_t tailedOffset;
+
+static int onEvent_tail(struct FMHandle* h, const struct FMEvent* event)
+{
+        printf(GREEN "%s :: %s %zu@%lu" RESET NL, __FUNCTION__, event->path,
+               event->len, (unsigned long)event->offset);
+
+        if (event->len) {
+                tailedOffset = event->offset;
+                strncat(tailed, event->data, event->len);
+        }
+        return FM_MONITOR;
+}
+
+void testFM_tail(void **state)
+{
+        struct State *s = *state;
+
+        system("rm -f " LOG "* && echo a > " LOG);
+
+        struct FMHandle fm = {0};
+        FileMonitor_init(&fm);
+
+        const struct FMOptions opt = {.flags = FM_TAIL, .onEvent = onEvent_tail};
+        assert_int_equal(1, FileMonitor_monitorWith(&fm, LOG, &opt, NULL, NULL, NULL));
+
+        tailed[0] = 0;
+        system("echo bc >> " LOG);
+        drain(&fm, s);
+        assert_string_equal("bc\n", tailed);
+        assert_int_equal(2, tailedOffset);
+
+        struct FMTailCheckpoint cp;
+        assert_int_equal(1, FileMonitor_tailCheckpoint(&fm, LOG, &cp));
+        assert_int_equal(5, cp.offset);
+
+        // truncated
+        tailed[0] = 0;
+        system("echo d > " LOG);
+        drain(&fm, s);
+        assert_string_equal("d\n", tailed);
+        assert_int_equal(0, tailedOffset);
+
+        // rotated
+        tailed[0] = 0;
+        system("mv " LOG " " LOG ".1 && echo e > " LOG);
+        drain(&fm, s);
+        assert_string_equal("e\n", tailed);
+
+        // resumed in a later run
+        system("echo f >> " LOG);
+        assert_int_equal(1, FileMonitor_tailCheckpoint(&fm, LOG, &cp));
+        FileMonitor_unMonitor(&fm, LOG);
+        drain(&fm, s);
+
+        tailed[0] = 0;
+        assert_int_equal(1, FileMonitor_monitorWith(&fm, LOG, &opt, NULL, NULL, NULL));
+        assert_int_equal(1, FileMonitor_tailResume(&fm, LOG, &cp));
+        system("echo g >> " LOG);
+        drain(&fm, s);
+        assert_string_equal("f\ng\n", tailed);
+}
+
+static int tailCalls;
+
+static int onEvent_tailTruncate(struct FMHandle* h, const struct FMEvent* event)
+{
+        printf(GREEN "%s :: %s %zu@%lu" RESET NL, __FUNCTION__, event->path,
+               event->len, (unsigned long)event->offset);
+
+        // copytruncate while the bytes are in use
+        if (0 == tailCalls++) {
+                assert_int_equal(0, truncate(event->path, 0));
+        }
+        const char *data = event->data;
+        assert_int_equal('a', data[0]);
+
+        tailedOffset = event->offset;
+        return FM_MONITOR;
+}
+
+void testFM_tailTruncated(void **state)
+{
+        struct State *s = *state;
+
+        system("rm -f " LOG "* && touch " LOG);
+
+        struct FMHandle fm = {0};
+        FileMonitor_init(&fm);
+
+        const struct FMOptions opt = {.flags = FM_TAIL, .onEvent = onEvent_tailTruncate};
+        assert_int_equal(1, FileMonitor_monitorWith(&fm, LOG, &opt, NULL, NULL, NULL));
+
+        // more than one window
+        tailCalls = 0;
+        system("head -c 200000 /dev/zero | tr '\\0' a >> " LOG);
+        drain(&fm, s);
+        assert_int_equal(1, tailCalls);
+
+        system("echo a >> " LOG);
+        drain(&fm, s);
+        assert_int_equal(2, tailCalls);
+        assert_int_equal(0, tailedOffset);
+
+        system("rm -f " LOG "*");
+}
+
+void testFM_tailBuffer(void **state)
+{
+        system("rm -f " LOG "* && touch " LOG);
+
+        struct FMHandle fm = {0};
+        FileMonitor_init(&fm);
+
+        // only handles that tail carry the window
+        assert_int_equal(1, FileMonitor_monitor(&fm, PATH, NULL, onUpdate, onDelete));
+        assert_true(NULL == fm.tail_buf);
+
+        const struct FMOptions opt = {.flags = FM_TAIL, .onEvent = onEvent_tail};
+        assert_int_equal(1, FileMonitor_monitorWith(&fm, LOG, &opt, NULL, NULL, NULL));
+        assert_true(NULL != fm.tail_buf);
+
+        FileMonitor_close(&fm);
+        assert_true(NULL == fm.tail_buf);
+        assert_int_equal(-1, fm.inotify_fd);
+
+        system("rm -f " LOG "*");
+}
+
+static uint64_t statSizes[2];
+
+static int onEvent_stat(struct FMHandle* h, const struct FMEvent* event)
+{
+        printf(GREEN "%s :: %s" RESET NL, __FUNCTION__, event->path);
+
+        check_expected(event->path);
+
+        statSizes[0] = event->stat_old->size;
+        statSizes[1] = event->stat_new->size;
+        return FM_MONITOR;
+}
+
+void testFM_statFilter(void **state)
+{
+        struct State *s = *state;
+
+        system("echo apa > " PATH " && touch -d 2020-01-01 " PATH);
+
+        struct FMHandle fm = {0};
+        FileMonitor_init(&fm);
+
+        const struct FMOptions opt = {.flags = FM_STAT_FILTER, .onEvent = onEvent_stat};
+        assert_int_equal(1, FileMonitor_monitorWith(&fm, PATH, &opt, NULL, NULL, NULL));
+
+        // opened for writing, closed untouched
+        fclose(fopen(PATH, "a"));
+        fclose(fopen(PATH, "a"));
+        drain(&fm, s);
+
+        system("echo bpa >> " PATH);
+        expect_string(onEvent_stat, event->path, PATH);
+        drain(&fm, s);
+        assert_int_equal(4, statSizes[0]);
+        assert_int_equal(8, statSizes[1]);
+}
+
+static int contexts[2];
+
+static int onEvent_subscriber(struct FMHandle* h, const struct FMEvent* event)
+{
+        printf(GREEN "%s :: %s" RESET NL, __FUNCTION__, event->path);
+
+        ++contexts[*(int *)event->context];
+        return FM_MONITOR;
+}
+
+void testFM_subscribe(void **state)
+{
+        struct State *s = *state;
+
+        struct FMHandle fm = {0};
+        FileMonitor_init(&fm);
+
+        int a = 0;
+        int b = 1;
+        const struct FMOptions opt_a = {.onEvent = onEvent_subscriber, .context = &a};
+        const struct FMOptions opt_b = {.onEvent = onEvent_subscriber, .context = &b};
+
+        assert_int_equal(1, FileMonitor_monitor(&fm, PATH, NULL, onUpdate, onDelete));
+        const int id_a = FileMonitor_subscribe(&fm, PATH, &opt_a, NULL, NULL, NULL);
+        const int id_b = FileMonitor_subscribe(&fm, "data/./watchedFile.txt", &opt_b,
+                                               NULL, NULL, NULL);
+        assert_true(0 <= id_a);
+        assert_true(0 <= id_b);
+        const int id = FileMonitor_id(&fm, PATH);
+        assert_true((0 <= id) && (id != id_a) && (id != id_b));
+
+        // one watch for the file, one for its directory
+        assert_int_equal(2, kernelWatches(fm.inotify_fd));
+
+        contexts[0] = contexts[1] = 0;
+        system("echo apa > " PATH);
+        expect_string(onUpdate, path, PATH);
+        drain(&fm, s);
+        assert_int_equal(1, contexts[0]);
+        assert_int_equal(1, contexts[1]);
+
+        assert_int_equal(1, FileMonitor_unsubscribe(&fm, id_a));
+        assert_int_equal(0, FileMonitor_unsubscribe(&fm, id_a));
+        assert_int_equal(0, FileMonitor_unsubscribe(&fm, id));
+        assert_int_equal(1, FileMonitor_unMonitor(&fm, PATH));
+        assert_int_equal(2, kernelWatches(fm.inotify_fd));
+
+        system("echo bpa > " PATH);
+        drain(&fm, s);
+        assert_int_equal(1, contexts[0]);
+        assert_int_equal(2, contexts[1]);
+
+        assert_int_equal(1, FileMonitor_unsubscribe(&fm, id_b));
+        drain(&fm, s);
+        assert_int_equal(0, kernelWatches(fm.inotify_fd));
+}
+
+void testFM_subscribeUnMonitor(void **state)
+{
+        struct State *s = *state;
+
+        struct FMHandle fm = {0};
+        FileMonitor_init(&fm);
+
+        int a = 0;
+        const struct FMOptions opt = {.onEvent = onEvent_subscriber, .context = &a};
+        const int id = FileMonitor_subscribe(&fm, PATH, &opt, NULL, NULL, NULL);
+        assert_true(0 <= id);
+
+        // the path lookups agree, a subscriber alone is not a monitor
+        assert_false(FileMonitor_isMonitored(&fm, PATH));
+        assert_int_equal(0, FileMonitor_unMonitor(&fm, PATH));
+
+        assert_int_equal(1, FileMonitor_monitor(&fm, PATH, NULL, onUpdate, onDelete));
+        assert_true(FileMonitor_isMonitored(&fm, PATH));
+        assert_int_equal(1, FileMonitor_unMonitor(&fm, PATH));
+        assert_false(FileMonitor_isMonitored(&fm, PATH));
+
+        // the subscriber is left
+        contexts[0] = 0;
+        system("echo apa > " PATH);
+        drain(&fm, s);
+        assert_int_equal(1, contexts[0]);
+
+        assert_int_equal(1, FileMonitor_unsubscribe(&fm, id));
+        assert_int_equal(0, kernelWatches(fm.inotify_fd));
+}
+
+void testFM_sharedInstance(void **state)
+{
+        struct State *s = *state;
+
+        static struct FMInstance inst;
+        static struct FMHandle a;
+        static struct FMHandle b;
+
+        assert_true(0 < FileMonitor_instanceInit(&inst));
+        assert_int_equal(inst.inotify_fd, FileMonitor_initShared(&a, &inst));
+        assert_int_equal(inst.inotify_fd, FileMonitor_initShared(&b, &inst));
+
+        assert_int_equal(1, FileMonitor_monitor(&a, PATH, NULL, onUpdate, onDelete));
+        assert_int_equal(1, FileMonitor_monitor(&b, PATH, NULL, onUpdate, onDelete));
+        assert_int_equal(1, FileMonitor_monitor(&b, PATH_2, NULL, onUpdate, onDelete));
+
+        // PATH, PATH_2 and data/
+        assert_int_equal(3, kernelWatches(inst.inotify_fd));
+
+        system("echo apa > " PATH);
+        system("echo apa > " PATH_2);
+        expect_string(onUpdate, path, PATH);
+        expect_string(onUpdate, path, PATH);
+        expect_string(onUpdate, path, PATH_2);
+        drain(&a, s);
+
+        // the watch stays for b
+        assert_int_equal(1, FileMonitor_unMonitor(&a, PATH));
+        assert_int_equal(3, kernelWatches(inst.inotify_fd));
+
+        system("echo bpa > " PATH);
+        expect_string(onUpdate, path, PATH);
+        drain(&b, s);
+
+        FileMonitor_leaveShared(&b);
+        drain(&a, s);
+        assert_int_equal(0, kernelWatches(inst.inotify_fd));
+
+        FileMonitor_instanceClose(&inst);
+        assert_int_equal(-1, a.inotify_fd);
+}
+
+void testFM_poll(void **state)
+{
+        system("echo apa > " PATH);
+
+        struct FMHandle fm = {0};
+        FileMonitor_init(&fm);
+        assert_int_equal(-1, FileMonitor_poll(&fm));
+
+        const struct FMOptions opt = {.backend = FM_BACKEND_POLL};
+        assert_int_equal(1, FileMonitor_monitorWith(&fm, PATH, &opt,
+                                                    NULL, onUpdate, onDelete));
+        assert_int_equal(0, kernelWatches(fm.inotify_fd));
+
+        // nothing changed, back off
+        assert_int_equal(2 * FM_POLL_MIN_MS, FileMonitor_poll(&fm));
+        assert_true(0 < FileMonitor_poll(&fm));
+
+        system("echo bpa >> " PATH);
+        fm.poll_at_ms = 0;
+        expect_string(onUpdate, path, PATH);
+        assert_int_equal(FM_POLL_MIN_MS, FileMonitor_poll(&fm));
+
+        unlink(PATH);
+        fm.poll_at_ms = 0;
+        expect_string(onDelete, path, PATH);
+        FileMonitor_poll(&fm);
+        assert_int_equal(1, FileMonitor_nonExistingPaths(&fm));
+
+        // back once it exists again
+        system("echo apa > " PATH);
+        fm.poll_at_ms = 0;
+        FileMonitor_poll(&fm);
+        assert_int_equal(0, FileMonitor_nonExistingPaths(&fm));
+}
+
+static void drainFan(struct FMHandle *h, struct State *s)
+{
+        while (0 < doSelect(h->fanotify_fd, &s->rfds)) {
+                FileMonitor_dispatch(h);
+        }
+}
+
+void testFM_fanotify(void **state)
+{
+        struct State *s = *state;
+
+        struct FMHandle fm = {0};
+        FileMonitor_init(&fm);
+
+        const struct FMOptions opt = {.backend = FM_BACKEND_FANOTIFY};
+        assert_int_equal(1, FileMonitor_monitorWith(&fm, PATH, &opt,
+                                                    NULL, onUpdate, onDelete));
+        const int id = FileMonitor_id(&fm, PATH);
+        if (0 > fm.fanotify_fd) {
+                // unprivileged, on inotify instead
+                assert_int_equal(FM_BACKEND_INOTIFY, fm.monitors[id].backend);
+                assert_true(0 <= fm.monitors[id].wd);
+                return;
+        }
+        assert_int_equal(FM_WD_FANOTIFY, fm.monitors[id].wd);
+        assert_int_equal(0, kernelWatches(fm.inotify_fd));
+        assert_int_not_equal(-1, fm.monitors[id].fan_bucket);
+
+        // events are routed by directory and name
+        assert_int_equal(1, FileMonitor_monitorWith(&fm, PATH_2, &opt,
+                                                    NULL, onUpdate, onDelete));
+        system("echo apa > " PATH);
+        expect_string(onUpdate, path, PATH);
+        drainFan(&fm, s);
+        system("echo apa > " PATH_2);
+        expect_string(onUpdate, path, PATH_2);
+        drainFan(&fm, s);
+        assert_int_equal(1, FileMonitor_unMonitor(&fm, PATH_2));
+
+        unlink(PATH);
+        expect_string(onDelete, path, PATH);
+        drainFan(&fm, s);
+        assert_int_equal(1, FileMonitor_nonExistingPaths(&fm));
+
+        system("echo bpa > " PATH);
+        expect_string(onUpdate, path, PATH);
+        drainFan(&fm, s);
+        assert_int_equal(0, FileMonitor_nonExistingPaths(&fm));
+
+        // the group goes with the last monitor
+        assert_int_equal(1, FileMonitor_unMonitor(&fm, PATH));
+        assert_int_equal(-1, fm.fanotify_fd);
+        for (int i = 0; i < FM_FAN_BUCKETS; i++) {
+                assert_int_equal(-1, fm.fan_buckets[i]);
+        }
+}
+
+void testFM_watchBudget(void **state)
+{
+        struct FMHandle fm = {0};
+        FileMonitor_init(&fm);
+        assert_true(0 < fm.watch_budget);
+
+        // the file and its directory
+        assert_int_equal(2, FileMonitor_setWatchBudget(&fm, 2));
+        assert_int_equal(1, FileMonitor_monitor(&fm, PATH, NULL, onUpdate, onDelete));
+        assert_int_equal(2, FileMonitor_watchesUsed(&fm));
+
+        // the quiet one is polled to make room
+        assert_int_equal(1, FileMonitor_monitor(&fm, PATH_2, NULL, onUpdate, onDelete));
+        const struct FM *a = &fm.monitors[FileMonitor_id(&fm, PATH)];
+        const struct FM *b = &fm.monitors[FileMonitor_id(&fm, PATH_2)];
+        assert_int_equal(FM_BACKEND_POLL, a->backend);
+        assert_true(a->demoted);
+        assert_int_equal(FM_BACKEND_INOTIFY, b->backend);
+        assert_int_equal(2, FileMonitor_watchesUsed(&fm));
+        assert_int_equal(2, kernelWatches(fm.inotify_fd));
+
+        // busy again, swaps with the other
+        system("echo apa >> " PATH);
+        fm.poll_at_ms = 0;
+        expect_string(onUpdate, path, PATH);
+        FileMonitor_poll(&fm);
+        assert_int_equal(FM_BACKEND_INOTIFY, a->backend);
+        assert_false(a->demoted);
+        assert_int_equal(FM_BACKEND_POLL, b->backend);
+        assert_int_equal(2, kernelWatches(fm.inotify_fd));
+}
+
+void testFM_watchBudgetShared(void **state)
+{
+        struct FMHandle fm = {0};
+        FileMonitor_init(&fm);
+        assert_int_equal(2, FileMonitor_setWatchBudget(&fm, 2));
+        assert_int_equal(1, FileMonitor_monitor(&fm, PATH, NULL, onUpdate, onDelete));
+
+        // the same file and directory, no new watch, nothing demoted
+        assert_int_equal(1, FileMonitor_monitor(&fm, "data/./watchedFile.txt", NULL,
+                                                onUpdate, onDelete));
+        const struct FM *a = &fm.monitors[FileMonitor_id(&fm, PATH)];
+        const struct FM *b = &fm.monitors[FileMonitor_id(&fm, "data/./watchedFile.txt")];
+        assert_int_equal(FM_BACKEND_INOTIFY, a->backend);
+        assert_int_equal(FM_BACKEND_INOTIFY, b->backend);
+        assert_int_equal(a->wd, b->wd);
+        assert_int_equal(2, FileMonitor_watchesUsed(&fm));
+        assert_int_equal(2, kernelWatches(fm.inotify_fd));
+}
+
+void testFM_watchBudgetDirs(void **state)
+{
+        system("mkdir -p data/budget && echo apa > data/budget/file");
+
+        struct FMHandle fm = {0};
+        FileMonitor_init(&fm);
+        assert_int_equal(3, FileMonitor_setWatchBudget(&fm, 3));
+        assert_int_equal(1, FileMonitor_monitor(&fm, PATH, NULL, onUpdate, onDelete));
+        assert_int_equal(2, FileMonitor_watchesUsed(&fm));
+
+        // the file fits, its directory makes room
+        assert_int_equal(1, FileMonitor_monitor(&fm, "data/budget/file", NULL, onUpdate, onDelete));
+        const struct FM *a = &fm.monitors[FileMonitor_id(&fm, PATH)];
+        const struct FM *b = &fm.monitors[FileMonitor_id(&fm, "data/budget/file")];
+        assert_int_equal(FM_BACKEND_POLL, a->backend);
+        assert_int_equal(FM_BACKEND_INOTIFY, b->backend);
+        assert_int_not_equal(-1, b->dir);
+        assert_int_equal(2, FileMonitor_watchesUsed(&fm));
+        assert_int_equal(2, kernelWatches(fm.inotify_fd));
+
+        // the count follows removal
+        assert_int_equal(1, FileMonitor_unMonitor(&fm, "data/budget/file"));
+        assert_int_equal(0, FileMonitor_watchesUsed(&fm));
+        assert_int_equal(0, kernelWatches(fm.inotify_fd));
+
+        system("rm -rf data/budget");
+}
+
+void testFM_lazy(void **state)
+{
+        struct State *s = *state;
+
+        system("echo apa > " PATH " && touch -d 2020-01-01 " PATH);
+        system("echo apa > " PATH_2 " && touch -d 2020-01-01 " PATH_2);
+        system("echo apa > " PATH_3 " && touch -d 2020-01-01 " PATH_3);
+
+        struct FMHandle fm = {0};
+        FileMonitor_init(&fm);
+        FileMonitor_setLazyMode(&fm, true);
+
+        // recorded, no watches yet
+        assert_int_equal(1, FileMonitor_monitor(&fm, PATH, onWatchSetup, onUpdate, onDelete));
+        assert_int_equal(1, FileMonitor_monitor(&fm, PATH_2, onWatchSetup, onUpdate, onDelete));
+        assert_int_equal(1, FileMonitor_monitor(&fm, PATH_3, onWatchSetup, onUpdate, onDelete));
+        assert_int_equal(0, FileMonitor_monitor(&fm, PATH_NOT_EXISTING, NULL, onUpdate, NULL));
+        assert_int_equal(0, kernelWatches(fm.inotify_fd));
+        assert_true(FileMonitor_isMonitored(&fm, PATH));
+
+        // changed before their watches are setup
+        system("echo bpa >> " PATH_2);
+        unlink(PATH_3);
+        system("echo apa > " PATH_NOT_EXISTING);
+
+        expect_string(onWatchSetup, path, PATH);
+        assert_int_equal(3, FileMonitor_setupLazy(&fm, 1));
+
+        expect_string(onWatchSetup, path, PATH_2);
+        expect_string(onUpdate, path, PATH_2);
+        expect_string(onDelete, path, PATH_3);
+        expect_string(onUpdate, path, PATH_NOT_EXISTING);
+        assert_int_equal(0, FileMonitor_setupLazy(&fm, 0));
+        assert_int_equal(1, FileMonitor_nonExistingPaths(&fm));
+
+        // watched from now on
+        system("echo bpa >> " PATH);
+        expect_string(onUpdate, path, PATH);
+        drain(&fm, s);
+}
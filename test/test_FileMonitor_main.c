@@ -34,6 +34,75 @@ void testFM_addMonitorOnDelete(void **state);
 
 void testFM_nonblocking(void **state);
 
+void testFM_generation(void **state);
+
+void testFM_takeDirty(void **state);
+
+void testFM_shards(void **state);
+
+void testFM_detectFileCreationOnDispatch(void **state);
+
+void testFM_sharedParentWatch(void **state);
+
+void testFM_reMonitorScheduled(void **state);
+
+void testFM_nonExistingPathsCount(void **state);
+
+void testFM_renameOver(void **state);
+void testFM_moveAway(void **state);
+
+void testFM_followLinks(void **state);
+
+void testFM_dirScoped(void **state);
+
+void testFM_monitorTree(void **state);
+
+void testFM_monitorGlob(void **state);
+
+void testFM_treeIgnore(void **state);
+
+void testFM_eventMask(void **state);
+
+void testFM_onEvent(void **state);
+
+void testFM_hashContent(void **state);
+
+void testFM_snapshot(void **state);
+
+void testFM_tail(void **state);
+
+void testFM_statFilter(void **state);
+
+void testFM_subscribe(void **state);
+
+void testFM_sharedInstance(void **state);
+
+void testFM_poll(void **state);
+
+void testFM_fanotify(void **state);
+
+void testFM_watchBudget(void **state);
+
+void testFM_lazy(void **state);
+
+void testFM_tailTruncated(void **state);
+
+void testFM_shardsCallbackLock(void **state);
+
+void testFM_watchBudgetDirs(void **state);
+
+void testFM_treeIgnoreNested(void **state);
+
+void testFM_eventMaskSharedDir(void **state);
+
+void testFM_subscribeUnMonitor(void **state);
+
+void testFM_tailBuffer(void **state);
+
+void testFM_watchBudgetShared(void **state);
+
+void testFM_shardsPollDirty(void **state);
+
 int main(int argc, char* argv[]) {
         const UnitTest tests[] = {
 
@@ -109,6 +178,146 @@ int main(int argc, char* argv[]) {
                                          testFM_setup,
                                          testFM_teardown),
 
+                unit_test_setup_teardown(testFM_generation,
+                                         testFM_setup,
+                                         testFM_teardown),
+
+                unit_test_setup_teardown(testFM_takeDirty,
+                                         testFM_setup,
+                                         testFM_teardown),
+
+                unit_test_setup_teardown(testFM_shards,
+                                         testFM_setup,
+                                         testFM_teardown),
+
+                unit_test_setup_teardown(testFM_detectFileCreationOnDispatch,
+                                         testFM_setup,
+                                         testFM_teardown),
+
+                unit_test_setup_teardown(testFM_sharedParentWatch,
+                                         testFM_setup,
+                                         testFM_teardown),
+
+                unit_test_setup_teardown(testFM_reMonitorScheduled,
+                                         testFM_setup,
+                                         testFM_teardown),
+
+                unit_test_setup_teardown(testFM_nonExistingPathsCount,
+                                         testFM_setup,
+                                         testFM_teardown),
+
+                unit_test_setup_teardown(testFM_renameOver,
+                                         testFM_setup,
+                                         testFM_teardown),
+
+                unit_test_setup_teardown(testFM_moveAway,
+                                         testFM_setup,
+                                         testFM_teardown),
+
+                unit_test_setup_teardown(testFM_followLinks,
+                                         testFM_setup,
+                                         testFM_teardown),
+
+                unit_test_setup_teardown(testFM_dirScoped,
+                                         testFM_setup,
+                                         testFM_teardown),
+
+                unit_test_setup_teardown(testFM_monitorTree,
+                                         testFM_setup,
+                                         testFM_teardown),
+
+                unit_test_setup_teardown(testFM_monitorGlob,
+                                         testFM_setup,
+                                         testFM_teardown),
+
+                unit_test_setup_teardown(testFM_treeIgnore,
+                                         testFM_setup,
+                                         testFM_teardown),
+
+                unit_test_setup_teardown(testFM_eventMask,
+                                         testFM_setup,
+                                         testFM_teardown),
+
+                unit_test_setup_teardown(testFM_onEvent,
+                                         testFM_setup,
+                                         testFM_teardown),
+
+                unit_test_setup_teardown(testFM_hashContent,
+                                         testFM_setup,
+                                         testFM_teardown),
+
+                unit_test_setup_teardown(testFM_snapshot,
+                                         testFM_setup,
+                                         testFM_teardown),
+
+                unit_test_setup_teardown(testFM_tail,
+                                         testFM_setup,
+                                         testFM_teardown),
+
+                unit_test_setup_teardown(testFM_statFilter,
+                                         testFM_setup,
+                                         testFM_teardown),
+
+                unit_test_setup_teardown(testFM_subscribe,
+                                         testFM_setup,
+                                         testFM_teardown),
+
+                unit_test_setup_teardown(testFM_sharedInstance,
+                                         testFM_setup,
+                                         testFM_teardown),
+
+                unit_test_setup_teardown(testFM_poll,
+                                         testFM_setup,
+                                         testFM_teardown),
+
+                unit_test_setup_teardown(testFM_fanotify,
+                                         testFM_setup,
+                                         testFM_teardown),
+
+                unit_test_setup_teardown(testFM_watchBudget,
+                                         testFM_setup,
+                                         testFM_teardown),
+
+                unit_test_setup_teardown(testFM_lazy,
+                                         testFM_setup,
+                                         testFM_teardown),
+
+                unit_test_setup_teardown(testFM_tailTruncated,
+                                         testFM_setup,
+                                         testFM_teardown),
+
+                unit_test_setup_teardown(testFM_shardsCallbackLock,
+                                         testFM_setup,
+                                         testFM_teardown),
+
+                unit_test_setup_teardown(testFM_watchBudgetDirs,
+                                         testFM_setup,
+                                         testFM_teardown),
+
+                unit_test_setup_teardown(testFM_treeIgnoreNested,
+                                         testFM_setup,
+                                         testFM_teardown),
+
+                unit_test_setup_teardown(testFM_eventMaskSharedDir,
+                                         testFM_setup,
+                                         testFM_teardown),
+
+                unit_test_setup_teardown(testFM_subscribeUnMonitor,
+                                         testFM_setup,
+                                         testFM_teardown),
+
+                unit_test_setup_teardown(testFM_tailBuffer,
+                                         testFM_setup,
+                                         testFM_teardown),
+
+                unit_test_setup_teardown(testFM_watchBudgetShared,
+                                         testFM_setup,
+                                         testFM_teardown),
+
+                unit_test_setup_teardown(testFM_shardsPollDirty,
+                                         testFM_setup,
+                                         testFM_teardown),
+
         };
 
         if(argc > 1) {